@@ -75,6 +75,10 @@
 #define MAGIC 8
 
 unsigned int arith_compress_bound(unsigned int size, int order) {
+    if (order & ARITH_ORDER_AUTO)
+        // Worst case of anything the selection may pick
+        order |= 1 | X_PACK | X_RLE | X_STRIPE;
+
     int N = (order>>8) & 0xff;
     if (!N) N=4;
     return (order == 0
@@ -89,6 +93,38 @@ unsigned int arith_compress_bound(unsigned int size, int order) {
 #define NSYM 256
 #include "c_simple_model.h"
 #endif
+#include "c_blocked_model.h"
+
+// The BLOCK_MODEL is only faster than SIMPLE_MODEL when the frequent
+// symbols are spread far down the list, which in practice means near
+// uniform data.  Both produce the same output, so we can choose per
+// block: above this many bits per symbol we use BLOCK_MODEL.  The
+// encoder uses the order-0 entropy and the decoder the actual ratio.
+#define ARITH_BLOCK_BITS 7
+
+// Returns the maximum symbol value + 1, and sets *block if the data is
+// high entropy enough to prefer BLOCK_MODEL.
+static unsigned int arith_model_params(unsigned char *in,
+                                       unsigned int in_size,
+                                       int *block) {
+    uint32_t F[256] = {0};
+    unsigned int i, m = 0;
+    double e = 0;
+
+    *block = 0;
+    if (htscodecs_hist8(in, in_size, F) < 0)
+        return 256;
+
+    for (i = 0; i < 256; i++) {
+        if (!F[i])
+            continue;
+        m = i;
+        e -= F[i] * log((double)F[i] / in_size);
+    }
+    *block = e / log(2) > ARITH_BLOCK_BITS * (double)in_size;
+
+    return m+1;
+}
 
 // Compresses in_size bytes from 'in' to *out_size bytes in 'out'.
 //
@@ -102,31 +138,36 @@ unsigned char *arith_compress_O0(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
 
-    unsigned int m = 0;
-    for (i = 0; i < in_size; i++)
-        if (m < in[i])
-            m = in[i];
-    m++;
+    int block;
+    unsigned int m = arith_model_params(in, in_size, &block);
     *out = m;
 
-    SIMPLE_MODEL(256,_) byte_model;
-    SIMPLE_MODEL(256,_init)(&byte_model, m);
-
     RangeCoder rc;
     RC_SetOutput(&rc, (char *)out+1);
     RC_SetOutputEnd(&rc, (char *)out + *out_size);
     RC_StartEncode(&rc);
 
-    for (i = 0; i < in_size; i++)
-        SIMPLE_MODEL(256, _encodeSymbol)(&byte_model, &rc, in[i]);
+    if (block) {
+        BLOCK_MODEL(256,_) byte_model;
+        BLOCK_MODEL(256,_init)(&byte_model, m);
+
+        for (i = 0; i < in_size; i++)
+            BLOCK_MODEL(256, _encodeSymbol)(&byte_model, &rc, in[i]);
+    } else {
+        SIMPLE_MODEL(256,_) byte_model;
+        SIMPLE_MODEL(256,_init)(&byte_model, m);
+
+        for (i = 0; i < in_size; i++)
+            SIMPLE_MODEL(256, _encodeSymbol)(&byte_model, &rc, in[i]);
+    }
 
     if (RC_FinishEncode(&rc) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -143,23 +184,31 @@ unsigned char *arith_uncompress_O0(unsigned char *in, unsigned int in_size,
     int i;
     unsigned int m = in[0] ? in[0] : 256;
 
-    SIMPLE_MODEL(256,_) byte_model;
-    SIMPLE_MODEL(256,_init)(&byte_model, m);
-
     unsigned char *out_free = NULL;
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
     RC_SetInput(&rc, (char *)in+1, (char *)in+in_size);
     RC_StartDecode(&rc);
 
-    for (i = 0; i < out_sz; i++)
-        out[i] = SIMPLE_MODEL(256, _decodeSymbol)(&byte_model, &rc);
+    if ((in_size-1) * 8.0 > ARITH_BLOCK_BITS * (double)out_sz) {
+        BLOCK_MODEL(256,_) byte_model;
+        BLOCK_MODEL(256,_init)(&byte_model, m);
+
+        for (i = 0; i < out_sz; i++)
+            out[i] = BLOCK_MODEL(256, _decodeSymbol)(&byte_model, &rc);
+    } else {
+        SIMPLE_MODEL(256,_) byte_model;
+        SIMPLE_MODEL(256,_init)(&byte_model, m);
+
+        for (i = 0; i < out_sz; i++)
+            out[i] = SIMPLE_MODEL(256, _decodeSymbol)(&byte_model, &rc);
+    }
 
     if (RC_FinishDecode(&rc) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     
@@ -176,28 +225,24 @@ unsigned char *arith_compress_O1(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
 
-    SIMPLE_MODEL(256,_) *byte_model =
-        htscodecs_tls_alloc(256 * sizeof(*byte_model));
-    if (!byte_model) {
-        free(out_free);
+    int block;
+    unsigned int m = arith_model_params(in, in_size, &block);
+    *out = m;
+
+    SIMPLE_MODEL(256,_) *byte_model = NULL;
+    BLOCK_MODEL(256,_) *blk_model = NULL;
+    void *models = block
+        ? (void *)(blk_model = htscodecs_tls_alloc(256 * sizeof(*blk_model)))
+        : (void *)(byte_model = htscodecs_tls_alloc(256 * sizeof(*byte_model)));
+    if (!models) {
+        htscodecs_free(out_free);
         return NULL;
     }
-    unsigned int m = 0;
-    if (1 || in_size > 1000) {
-        for (i = 0; i < in_size; i++)
-            if (m < in[i])
-                m = in[i];
-        //fprintf(stderr, "%d max %d\n", in_size, m);
-        m++;
-    }
-    *out = m;
-    for (i = 0; i < 256; i++)
-        SIMPLE_MODEL(256,_init)(&byte_model[i], m);
 
     RangeCoder rc;
     RC_SetOutput(&rc, (char *)out+1);
@@ -205,21 +250,34 @@ unsigned char *arith_compress_O1(unsigned char *in, unsigned int in_size,
     RC_StartEncode(&rc);
 
     uint8_t last = 0;
-    for (i = 0; i < in_size; i++) {
-        SIMPLE_MODEL(256, _encodeSymbol)(&byte_model[last], &rc, in[i]);
-        last = in[i];
+    if (block) {
+        for (i = 0; i < 256; i++)
+            BLOCK_MODEL(256,_init)(&blk_model[i], m);
+
+        for (i = 0; i < in_size; i++) {
+            BLOCK_MODEL(256, _encodeSymbol)(&blk_model[last], &rc, in[i]);
+            last = in[i];
+        }
+    } else {
+        for (i = 0; i < 256; i++)
+            SIMPLE_MODEL(256,_init)(&byte_model[i], m);
+
+        for (i = 0; i < in_size; i++) {
+            SIMPLE_MODEL(256, _encodeSymbol)(&byte_model[last], &rc, in[i]);
+            last = in[i];
+        }
     }
 
     if (RC_FinishEncode(&rc) < 0) {
-        free(out_free);
-        htscodecs_tls_free(byte_model);
+        htscodecs_free(out_free);
+        htscodecs_tls_free(models);
         return NULL;
     }
 
     // Finalise block size and return it
     *out_size = RC_OutSize(&rc)+1;
 
-    htscodecs_tls_free(byte_model);
+    htscodecs_tls_free(models);
     return out;
 }
 
@@ -230,38 +288,52 @@ unsigned char *arith_uncompress_O1(unsigned char *in, unsigned int in_size,
     unsigned char *out_free = NULL;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
 
-    SIMPLE_MODEL(256,_) *byte_model =
-        htscodecs_tls_alloc(256 * sizeof(*byte_model));
-    if (!byte_model) {
-        free(out_free);
+    int block = (in_size-1) * 8.0 > ARITH_BLOCK_BITS * (double)out_sz;
+    SIMPLE_MODEL(256,_) *byte_model = NULL;
+    BLOCK_MODEL(256,_) *blk_model = NULL;
+    void *models = block
+        ? (void *)(blk_model = htscodecs_tls_alloc(256 * sizeof(*blk_model)))
+        : (void *)(byte_model = htscodecs_tls_alloc(256 * sizeof(*byte_model)));
+    if (!models) {
+        htscodecs_free(out_free);
         return NULL;
     }
 
-    unsigned int m = in[0] ? in[0] : 256, i;
-    for (i = 0; i < 256; i++)
-        SIMPLE_MODEL(256,_init)(&byte_model[i], m);
-
     RC_SetInput(&rc, (char *)in+1, (char *)in+in_size);
     RC_StartDecode(&rc);
 
+    unsigned int m = in[0] ? in[0] : 256, i;
     unsigned char last = 0;
-    for (i = 0; i < out_sz; i++) {
-        out[i] = SIMPLE_MODEL(256, _decodeSymbol)(&byte_model[last], &rc);
-        last = out[i];
+    if (block) {
+        for (i = 0; i < 256; i++)
+            BLOCK_MODEL(256,_init)(&blk_model[i], m);
+
+        for (i = 0; i < out_sz; i++) {
+            out[i] = BLOCK_MODEL(256, _decodeSymbol)(&blk_model[last], &rc);
+            last = out[i];
+        }
+    } else {
+        for (i = 0; i < 256; i++)
+            SIMPLE_MODEL(256,_init)(&byte_model[i], m);
+
+        for (i = 0; i < out_sz; i++) {
+            out[i] = SIMPLE_MODEL(256, _decodeSymbol)(&byte_model[last], &rc);
+            last = out[i];
+        }
     }
 
     if (RC_FinishDecode(&rc) < 0) {
-        htscodecs_tls_free(byte_model);
-        free(out_free);
+        htscodecs_tls_free(models);
+        htscodecs_free(out_free);
         return NULL;
     }
     
-    htscodecs_tls_free(byte_model);
+    htscodecs_tls_free(models);
     return out;
 }
 
@@ -281,7 +353,7 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -297,7 +369,7 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
     *out = m;
 
     SIMPLE_MODEL(256,_) *byte_model;
-    byte_model = malloc(256*256*sizeof(*byte_model));
+    byte_model = htscodecs_malloc(256*256*sizeof(*byte_model));
     for (i = 0; i < 256; i++)
         for (j = 0; j < 256; j++)
             SIMPLE_MODEL(256,_init)(&byte_model[i*256+j], m);
@@ -314,9 +386,9 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
         last1 = in[i];
     }
 
-    free(byte_model);
+    htscodecs_free(byte_model);
     if (RC_FinishEncode(&rc) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -336,7 +408,7 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
     unsigned char *out_free = NULL;
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -352,7 +424,7 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
     *out = m;
 
     SIMPLE_MODEL(256,_) *byte_model;
-    byte_model = malloc(256*256*sizeof(*byte_model));
+    byte_model = htscodecs_malloc(256*256*sizeof(*byte_model));
     for (i = 0; i < 256; i++)
         for (j = 0; j < 256; j++)
             SIMPLE_MODEL(256,_init)(&byte_model[i*256+j], m);
@@ -379,9 +451,9 @@ unsigned char *arith_compress_O2(unsigned char *in, unsigned int in_size,
         last1 = in[i];
     }
 
-    free(byte_model);
+    htscodecs_free(byte_model);
     if (RC_FinishEncode(&rc) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -397,7 +469,7 @@ unsigned char *arith_uncompress_O2(unsigned char *in, unsigned int in_size,
     RangeCoder rc;
 
     SIMPLE_MODEL(256,_) *byte_model;
-    byte_model = malloc(256*256*sizeof(*byte_model));
+    byte_model = htscodecs_malloc(256*256*sizeof(*byte_model));
     unsigned int m = in[0] ? in[0] : 256, i, j;
     for (i = 0; i < 256; i++)
         for (j = 0; j < 256; j++)
@@ -405,7 +477,7 @@ unsigned char *arith_uncompress_O2(unsigned char *in, unsigned int in_size,
     
     unsigned char *out_free = NULL;
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -419,9 +491,9 @@ unsigned char *arith_uncompress_O2(unsigned char *in, unsigned int in_size,
         last1 = out[i];
     }
 
-    free(byte_model);
+    htscodecs_free(byte_model);
     if (RC_FinishDecode(&rc) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     
@@ -445,7 +517,7 @@ unsigned char *arith_compress_O0_RLE(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -463,7 +535,7 @@ unsigned char *arith_compress_O0_RLE(unsigned char *in, unsigned int in_size,
     SIMPLE_MODEL(NSYM,_) *run_model =
         htscodecs_tls_alloc(NSYM * sizeof(*run_model));
     if (!run_model) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -501,7 +573,7 @@ unsigned char *arith_compress_O0_RLE(unsigned char *in, unsigned int in_size,
 
     if (RC_FinishEncode(&rc) < 0) {
         htscodecs_tls_free(run_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -523,7 +595,7 @@ unsigned char *arith_uncompress_O0_RLE(unsigned char *in, unsigned int in_size,
     unsigned char *out_free = NULL;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -533,7 +605,7 @@ unsigned char *arith_uncompress_O0_RLE(unsigned char *in, unsigned int in_size,
     SIMPLE_MODEL(NSYM,_) *run_model =
         htscodecs_tls_alloc(NSYM * sizeof(*run_model));
     if (!run_model) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -563,7 +635,7 @@ unsigned char *arith_uncompress_O0_RLE(unsigned char *in, unsigned int in_size,
 
     if (RC_FinishDecode(&rc) < 0) {
         htscodecs_tls_free(run_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -579,7 +651,7 @@ unsigned char *arith_compress_O1_RLE(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -594,7 +666,7 @@ unsigned char *arith_compress_O1_RLE(unsigned char *in, unsigned int in_size,
     SIMPLE_MODEL(256,_) *byte_model =
         htscodecs_tls_alloc(256 * sizeof(*byte_model));
     if (!byte_model) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     for (i = 0; i < 256; i++)
@@ -604,7 +676,7 @@ unsigned char *arith_compress_O1_RLE(unsigned char *in, unsigned int in_size,
         htscodecs_tls_alloc(NSYM * sizeof(*run_model));
     if (!run_model) {
         htscodecs_tls_free(byte_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     for (i = 0; i < NSYM; i++)
@@ -642,7 +714,7 @@ unsigned char *arith_compress_O1_RLE(unsigned char *in, unsigned int in_size,
     if (RC_FinishEncode(&rc) < 0) {
         htscodecs_tls_free(byte_model);
         htscodecs_tls_free(run_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -665,14 +737,14 @@ unsigned char *arith_uncompress_O1_RLE(unsigned char *in, unsigned int in_size,
     unsigned char *out_free = NULL;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
     SIMPLE_MODEL(256,_) *byte_model =
         htscodecs_tls_alloc(256 * sizeof(*byte_model));
     if (!byte_model) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     for (i = 0; i < 256; i++)
@@ -682,7 +754,7 @@ unsigned char *arith_uncompress_O1_RLE(unsigned char *in, unsigned int in_size,
         htscodecs_tls_alloc(NSYM * sizeof(*run_model));
     if (!run_model) {
         htscodecs_tls_free(byte_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     for (i = 0; i < NSYM; i++)
@@ -713,7 +785,7 @@ unsigned char *arith_uncompress_O1_RLE(unsigned char *in, unsigned int in_size,
     if (RC_FinishDecode(&rc) < 0) {
         htscodecs_tls_free(byte_model);
         htscodecs_tls_free(run_model);
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -740,13 +812,22 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
 
     if (!out) {
         *out_size = arith_compress_bound(in_size, order);
-        if (!(out = malloc(*out_size))) {
+        if (!(out = htscodecs_malloc(*out_size))) {
             *out_size = 0;
             return NULL;
         }
     }
     unsigned char *out_end = out + *out_size;
 
+    // Replace the order with an estimated best one.  If this is STRIPE
+    // then each sub-stream is also auto-selected instead of brute forced.
+    int auto_lanes = 0;
+    if (order & ARITH_ORDER_AUTO) {
+        order = (order & X_NOSZ)
+            | htscodecs_auto_order(in, in_size, (order>>8) & 0xff, 1);
+        auto_lanes = order & X_STRIPE;
+    }
+
     if (in_size <= 20)
         order &= ~X_STRIPE;
 
@@ -769,7 +850,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         if (N > in_size)
             N = in_size;
 
-        unsigned char *transposed = malloc(in_size);
+        unsigned char *transposed = htscodecs_malloc(in_size);
         unsigned int part_len[256];
         unsigned int idx[256];
         if (!transposed) {
@@ -798,7 +879,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         *out = order & ~X_NOSZ;
         c_meta_len += var_put_u32(out+c_meta_len, out_end, in_size);
         if (c_meta_len >= *out_size) {
-            free(transposed);
+            htscodecs_free(transposed);
             *out_size = 0;
             return NULL;
         }
@@ -858,6 +939,12 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
 //                        {1, 128},
 //                        {1, 128}};
 
+            if (auto_lanes) {
+                // A single estimated method, without nested striping
+                m[MIN(i,3)][0] = 1;
+                m[MIN(i,3)][1] = ARITH_ORDER_AUTO | (1<<8);
+            }
+
             for (j = 1; j <= m[MIN(i,3)][0]; j++) {
                 if (out2 - out > *out_size)
                     continue; // an error, but caught in best_sz check later
@@ -876,7 +963,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
             }
 
             if (best_sz == INT_MAX) {
-                free(transposed);
+                htscodecs_free(transposed);
                 *out_size = 0;
                 return NULL;
             }
@@ -886,7 +973,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
                                       out2, &olen2,
                                       m[MIN(i,3)][best_j] | X_NOSZ);
                 if (!r) {
-                    free(transposed);
+                    htscodecs_free(transposed);
                     *out_size = 0;
                     return NULL;
                 }
@@ -895,7 +982,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
             c_meta_len += var_put_u32(out+c_meta_len, out_end, olen2);
         }
         memmove(out+c_meta_len, out2_start, out2-out2_start);
-        free(transposed);
+        htscodecs_free(transposed);
         *out_size = c_meta_len + out2-out2_start;
         return out;
     }
@@ -930,7 +1017,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         if (!packed) {
             out[0] &= ~X_PACK;
             do_pack = 0;
-            free(packed);
+            htscodecs_free(packed);
             packed = NULL;
         } else {
             in = packed;
@@ -966,7 +1053,7 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
             *out_size = in_size; // Didn't fit with bz2; force X_CAT below instead
 #else
         fprintf(stderr, "Htscodecs has been compiled without libbz2 support\n");
-        free(out);
+        htscodecs_free(out);
         *out_size = 0;
         return NULL;
 #endif
@@ -996,8 +1083,8 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         }
 
         if (!r) {
-            free(rle);
-            free(packed);
+            htscodecs_free(rle);
+            htscodecs_free(packed);
             *out_size = 0;
             return NULL;
         }
@@ -1008,8 +1095,8 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         out[0] |= X_CAT | no_size;
 
         if (out + c_meta_len + in_size > out_end) {
-            free(rle);
-            free(packed);
+            htscodecs_free(rle);
+            htscodecs_free(packed);
             *out_size = 0;
             return NULL;
         }
@@ -1017,8 +1104,8 @@ unsigned char *arith_compress_to(unsigned char *in,  unsigned int in_size,
         *out_size = in_size;
     }
 
-    free(rle);
-    free(packed);
+    htscodecs_free(rle);
+    htscodecs_free(packed);
 
     *out_size += c_meta_len;
 
@@ -1030,6 +1117,53 @@ unsigned char *arith_compress(unsigned char *in, unsigned int in_size,
     return arith_compress_to(in, in_size, NULL, out_size, order);
 }
 
+/*-----------------------------------------------------------------------------
+ * Batch compression.
+ *
+ * Each entry is an independent job.  The model memory comes from the
+ * per-thread htscodecs_tls_alloc pool, so it is allocated once per thread
+ * rather than once per entry.
+ */
+
+// Below this total input size the batch is always run serially.
+#define ARITH_BATCH_MIN_PAR 65536
+
+typedef struct {
+    arith_batch *b;
+    int err;    // set by any failing job; benign race as only ever set to 1
+} arith_batch_arg;
+
+static void arith_batch_job(void *arg, int i) {
+    arith_batch_arg *a = (arith_batch_arg *)arg;
+    arith_batch *b = &a->b[i];
+
+    unsigned char *out = arith_compress_to(b->in, b->in_size,
+                                           b->out, &b->out_size, b->order);
+    if (!out) {
+        b->out_size = 0;
+        a->err = 1;
+    } else {
+        b->out = out;
+    }
+}
+
+int arith_compress_batch(arith_batch *b, int n, int nthreads) {
+    uint64_t tot = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        tot += b[i].in_size;
+    if (tot < ARITH_BATCH_MIN_PAR)
+        nthreads = 1;
+
+    arith_batch_arg a;
+    a.b = b;
+    a.err = 0;
+    htscodecs_par_run(nthreads, arith_batch_job, &a, n);
+
+    return a.err ? -1 : 0;
+}
+
 unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
                                    unsigned char *out, unsigned int *out_size) {
     unsigned char *in_end = in + in_size;
@@ -1055,13 +1189,13 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
         if (!out) {
             if (ulen >= INT_MAX)
                 return NULL;
-            if (!(out_free = out = malloc(ulen))) {
+            if (!(out_free = out = htscodecs_malloc(ulen))) {
                 return NULL;
             }
             *out_size = ulen;
         }
         if (ulen != *out_size) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
 
@@ -1071,7 +1205,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
             c_meta_len += var_get_u32(in+c_meta_len, in_end, &clenN[i]);
             clen_tot += clenN[i];
             if (c_meta_len > in_size || clenN[i] > in_size || clenN[i] < 1) {
-                free(out_free);
+                htscodecs_free(out_free);
                 return NULL;
             }
         }
@@ -1080,7 +1214,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
         // how much we really use we limit it so the recursion becomes easier
         // to limit.
         if (c_meta_len + clen_tot > in_size) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
         in_size = c_meta_len + clen_tot;
@@ -1088,22 +1222,22 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
         //fprintf(stderr, "    stripe meta %d\n", c_meta_len); //c-size
 
         // Uncompress the N streams
-        unsigned char *outN = malloc(ulen);
+        unsigned char *outN = htscodecs_malloc(ulen);
         if (!outN) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
         for (i = 0; i < N; i++) {
             olen = ulenN[i];
             if (in_size < c_meta_len) {
-                free(out_free);
-                free(outN);
+                htscodecs_free(out_free);
+                htscodecs_free(outN);
                 return NULL;
             }
             if (!arith_uncompress_to(in+c_meta_len, in_size-c_meta_len, outN + idxN[i], &olen)
                 || olen != ulenN[i]) {
-                free(out_free);
-                free(outN);
+                htscodecs_free(out_free);
+                htscodecs_free(outN);
                 return NULL;
             }
             c_meta_len += clenN[i];
@@ -1111,7 +1245,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
 
         unstripe(out, outN, ulen, N, idxN);
 
-        free(outN);
+        htscodecs_free(outN);
         *out_size = ulen;
         return out;
     }
@@ -1147,7 +1281,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
 
     if (!out) {
         *out_size = osz;
-        if (!(out_free = out = malloc(*out_size)))
+        if (!(out_free = out = htscodecs_malloc(*out_size)))
             return NULL;
     } else {
         if (*out_size < osz)
@@ -1170,7 +1304,7 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
 
     // Format is pack meta data if present, followed by compressed data.
     if (do_pack) {
-        if (!(tmp_free = tmp = malloc(*out_size)))
+        if (!(tmp_free = tmp = htscodecs_malloc(*out_size)))
             goto err;
         tmp1 = tmp;  // uncompress
         tmp2 = out;  // unpack
@@ -1266,14 +1400,14 @@ unsigned char *arith_uncompress_to(unsigned char *in,  unsigned int in_size,
     }
 
     if (tmp)
-        free(tmp);
+        htscodecs_free(tmp);
 
     *out_size = tmp2_size;
     return tmp2;
 
  err:
-    free(tmp_free);
-    free(out_free);
+    htscodecs_free(tmp_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -38,6 +38,12 @@
 extern "C" {
 #endif
 
+// Automatic selection of order-0/1, PACK, RLE, STRIPE and CAT based on
+// cheap entropy estimates of the input, in place of brute force trials.
+// Bits 8-15 may hold the STRIPE width to consider (default 4).
+// This is not part of the file format; it only steers the encoder.
+#define ARITH_ORDER_AUTO (1<<19)
+
 unsigned char *arith_compress(unsigned char *in, unsigned int in_size,
                               unsigned int *out_size, int order);
 
@@ -53,6 +59,30 @@ unsigned char *arith_uncompress_to(unsigned char *in, unsigned int in_size,
 
 unsigned int arith_compress_bound(unsigned int size, int order);
 
+/*
+ * Batch compression of many independent blocks in a single call.
+ *
+ * Each entry is compressed as if by arith_compress_to(in, in_size, out,
+ * &out_size, order).  On input out may be NULL, in which case it is
+ * malloced, or a buffer of out_size bytes which should be at least
+ * arith_compress_bound(in_size, order).  On output out_size holds the
+ * compressed size, or 0 if that entry failed.
+ *
+ * With nthreads > 1 the entries are compressed concurrently by up to
+ * that many threads.  Small batches are always run serially.
+ *
+ * Returns 0 on success, or -1 if any entry failed.
+ */
+typedef struct {
+    unsigned char *in;
+    unsigned int in_size;
+    unsigned char *out;
+    unsigned int out_size;
+    int order;
+} arith_batch;
+
+int arith_compress_batch(arith_batch *b, int n, int nthreads);
+
 #ifdef __cplusplus
 }
 #endif
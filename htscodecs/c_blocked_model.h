@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2012, 2018-2019 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include "c_range_coder.h"
+
+/*
+ *--------------------------------------------------------------------------
+ * A blocked variant of the simple frequency model.
+ *
+ * Define NSYM to be an integer value before including this file, after
+ * including c_simple_model.h for the same NSYM.
+ *
+ * This keeps exactly the same approximately sorted list of symbols and
+ * frequencies as SIMPLE_MODEL, and so produces an identical bit stream,
+ * but additionally holds the frequency total for each block of
+ * BLOCK_MODEL_BLK entries and the list position of every symbol.
+ *
+ * The simple model finds a symbol (encode) or cumulative frequency
+ * (decode) by a linear scan of the list.  That is fast on highly skewed
+ * data where the common symbols are at the start, but O(NSYM) for near
+ * uniform distributions.  Here we step over whole blocks first, making
+ * the search O(NSYM/BLOCK_MODEL_BLK + BLOCK_MODEL_BLK), at the cost of a
+ * larger model and slightly more work per update.
+ *--------------------------------------------------------------------------
+ */
+
+//-----------------------------------------------------------------------------
+// Bits we want included once only - constants, types, etc
+#ifndef C_BLOCKED_MODEL_H
+#define C_BLOCKED_MODEL_H
+
+#define BLOCK_MODEL_BLK 16
+#define BLOCK_MODEL(a,b) PASTE3(BLOCK_MODEL,a,b)
+#endif /* C_BLOCKED_MODEL_H */
+
+
+//-----------------------------------------------------------------------------
+// Bits we regenerate for each NSYM value.
+
+#define BLOCK_MODEL_NBLK ((NSYM + BLOCK_MODEL_BLK-1) / BLOCK_MODEL_BLK)
+
+typedef struct {
+    SIMPLE_MODEL(NSYM,_) m;
+
+    uint32_t BlkFreq[BLOCK_MODEL_NBLK]; // Sum of m.F[] Freq per block
+    uint16_t Pos[NSYM];                 // Index of each symbol in m.F[]
+} BLOCK_MODEL(NSYM,_);
+
+
+static inline void BLOCK_MODEL(NSYM,_init)(BLOCK_MODEL(NSYM,_) *b, int max_sym) {
+    int i;
+
+    SIMPLE_MODEL(NSYM,_init)(&b->m, max_sym);
+
+    for (i = 0; i < BLOCK_MODEL_NBLK; i++)
+        b->BlkFreq[i] = 0;
+    for (i = 0; i < NSYM; i++) {
+        b->Pos[i] = i;
+        b->BlkFreq[i / BLOCK_MODEL_BLK] += b->m.F[i].Freq;
+    }
+}
+
+
+static inline void BLOCK_MODEL(NSYM,_normalize)(BLOCK_MODEL(NSYM,_) *b) {
+    int i;
+
+    SIMPLE_MODEL(NSYM,_normalize)(&b->m);
+
+    for (i = 0; i < BLOCK_MODEL_NBLK; i++)
+        b->BlkFreq[i] = 0;
+    for (i = 0; i < NSYM; i++)
+        b->BlkFreq[i / BLOCK_MODEL_BLK] += b->m.F[i].Freq;
+}
+
+// Increments the symbol at position p and keeps the list approximately
+// sorted, as per SIMPLE_MODEL.  Returns the symbol.
+static inline uint16_t BLOCK_MODEL(NSYM,_update)(BLOCK_MODEL(NSYM,_) *b,
+                                                 int p) {
+    SymFreqs *s = &b->m.F[p];
+
+    s->Freq      += STEP;
+    b->m.TotFreq += STEP;
+    b->BlkFreq[p / BLOCK_MODEL_BLK] += STEP;
+
+    if (b->m.TotFreq > MAX_FREQ)
+        BLOCK_MODEL(NSYM,_normalize)(b);
+
+    /* Keep approx sorted */
+    if (s[0].Freq > s[-1].Freq) {
+        SymFreqs t = s[0];
+        s[0] = s[-1];
+        s[-1] = t;
+        b->Pos[s[0].Symbol] = p;
+        b->Pos[t.Symbol] = p-1;
+        if (p % BLOCK_MODEL_BLK == 0) {
+            // Moved between blocks
+            b->BlkFreq[p / BLOCK_MODEL_BLK]     += s[0].Freq - t.Freq;
+            b->BlkFreq[p / BLOCK_MODEL_BLK - 1] += t.Freq - s[0].Freq;
+        }
+        return t.Symbol;
+    }
+
+    return s->Symbol;
+}
+
+static inline void BLOCK_MODEL(NSYM,_encodeSymbol)(BLOCK_MODEL(NSYM,_) *b,
+                                                   RangeCoder *rc,
+                                                   uint16_t sym) {
+    int p = b->Pos[sym], i;
+    uint32_t AccFreq = 0;
+
+    for (i = 0; i < p / BLOCK_MODEL_BLK; i++)
+        AccFreq += b->BlkFreq[i];
+    for (i *= BLOCK_MODEL_BLK; i < p; i++)
+        AccFreq += b->m.F[i].Freq;
+
+    RC_Encode(rc, AccFreq, b->m.F[p].Freq, b->m.TotFreq);
+    BLOCK_MODEL(NSYM,_update)(b, p);
+}
+
+static inline uint16_t BLOCK_MODEL(NSYM,_decodeSymbol)(BLOCK_MODEL(NSYM,_) *b,
+                                                       RangeCoder *rc) {
+    uint32_t freq = RC_GetFreq(rc, b->m.TotFreq);
+    uint32_t AccFreq = 0;
+    int i, p;
+
+    if (freq > MAX_FREQ)
+        return 0; // error
+
+    for (i = 0; i < BLOCK_MODEL_NBLK; i++) {
+        if (AccFreq + b->BlkFreq[i] > freq)
+            break;
+        AccFreq += b->BlkFreq[i];
+    }
+    if (i == BLOCK_MODEL_NBLK)
+        return 0; // error
+
+    for (p = i * BLOCK_MODEL_BLK; AccFreq + b->m.F[p].Freq <= freq; p++)
+        AccFreq += b->m.F[p].Freq;
+
+    RC_Decode(rc, AccFreq, b->m.F[p].Freq, b->m.TotFreq);
+    return BLOCK_MODEL(NSYM,_update)(b, p);
+}
+
+#undef BLOCK_MODEL_NBLK
@@ -80,6 +80,13 @@
 
 #define QMAX 256
 #define QBITS 12
+
+// Compact quality models, used when max_sym is small enough.  These
+// behave identically to QMAX models, but with 16 or 64 symbols the
+// 64K contexts take 5MB or 17MB instead of 68MB.  This reduces cache
+// misses and the cost of initialising the models for each block.
+#define QMAX_TINY  16
+#define QMAX_SMALL 64
 #define QSIZE (1<<QBITS)
 
 #define NSYM 2
@@ -89,6 +96,14 @@
 #define NSYM QMAX
 //#include "c_escape_model.h"
 #include "c_simple_model.h"
+
+#undef NSYM
+#define NSYM QMAX_SMALL
+#include "c_simple_model.h"
+
+#undef NSYM
+#define NSYM QMAX_TINY
+#include "c_simple_model.h"
 //#include "c_cdf_model.h"
 //#include "c_cdf16_model.h"
 
@@ -310,7 +325,10 @@ static void dump_params(fqz_gparams *gp) {
 }
 
 typedef struct {
-    SIMPLE_MODEL(QMAX,_) *qual;
+    // Only one of these is used, depending on max_sym
+    SIMPLE_MODEL(QMAX,_)       *qual;
+    SIMPLE_MODEL(QMAX_SMALL,_) *qual_s;
+    SIMPLE_MODEL(QMAX_TINY,_)  *qual_t;
     SIMPLE_MODEL(256,_)   len[4];
     SIMPLE_MODEL(2,_)     revcomp;
     SIMPLE_MODEL(256,_)   sel;
@@ -320,11 +338,25 @@ typedef struct {
 static int fqz_create_models(fqz_model *m, fqz_gparams *gp) {
     int i;
 
-    if (!(m->qual = htscodecs_tls_alloc(sizeof(*m->qual) * CTX_SIZE)))
-        return -1;
-
-    for (i = 0; i < CTX_SIZE; i++)
-        SIMPLE_MODEL(QMAX,_init)(&m->qual[i], gp->max_sym+1);
+    m->qual = NULL;
+    m->qual_s = NULL;
+    m->qual_t = NULL;
+    if (gp->max_sym < QMAX_TINY) {
+        if (!(m->qual_t = htscodecs_tls_alloc(sizeof(*m->qual_t) * CTX_SIZE)))
+            return -1;
+        for (i = 0; i < CTX_SIZE; i++)
+            SIMPLE_MODEL(QMAX_TINY,_init)(&m->qual_t[i], gp->max_sym+1);
+    } else if (gp->max_sym < QMAX_SMALL) {
+        if (!(m->qual_s = htscodecs_tls_alloc(sizeof(*m->qual_s) * CTX_SIZE)))
+            return -1;
+        for (i = 0; i < CTX_SIZE; i++)
+            SIMPLE_MODEL(QMAX_SMALL,_init)(&m->qual_s[i], gp->max_sym+1);
+    } else {
+        if (!(m->qual = htscodecs_tls_alloc(sizeof(*m->qual) * CTX_SIZE)))
+            return -1;
+        for (i = 0; i < CTX_SIZE; i++)
+            SIMPLE_MODEL(QMAX,_init)(&m->qual[i], gp->max_sym+1);
+    }
 
     for (i = 0; i < 4; i++)
         SIMPLE_MODEL(256,_init)(&m->len[i],256);
@@ -339,6 +371,8 @@ static int fqz_create_models(fqz_model *m, fqz_gparams *gp) {
 
 static void fqz_destroy_models(fqz_model *m) {
     htscodecs_tls_free(m->qual);
+    htscodecs_tls_free(m->qual_s);
+    htscodecs_tls_free(m->qual_t);
 }
 
 static inline unsigned int fqz_update_ctx(fqz_param *pm, fqz_state *state, int q) {
@@ -389,11 +423,17 @@ static inline unsigned int fqz_update_ctx(fqz_param *pm, fqz_state *state, int q
 // One_param is -1 to gather stats on all data, or >= 0 to gather data
 // on one specific selector parameter.  Used only in TEST_MAIN via
 // fqz_manual_parameters at the moment.
-void fqz_qual_stats(fqz_slice *s,
-                    unsigned char *in, size_t in_size,
-                    fqz_param *pm,
-                    uint32_t qhist[256],
-                    int one_param) {
+//
+// With stride > 1 only every stride-th record contributes to the
+// positional histograms and duplicate detection, which dominate the
+// cost.  The symbol histogram and per-record average qualities are
+// still computed on all data, as the qmap and selectors depend on them.
+static void fqz_qual_stats_sampled(fqz_slice *s,
+                                   unsigned char *in, size_t in_size,
+                                   fqz_param *pm,
+                                   uint32_t qhist[256],
+                                   int one_param,
+                                   int stride) {
 #define NP 32
     uint32_t qhistb[NP][256] = {{0}};  // both
     uint32_t qhist1[NP][256] = {{0}};  // READ1 only
@@ -425,10 +465,20 @@ void fqz_qual_stats(fqz_slice *s,
     }
 
     // Dedup detection and histogram stats gathering
-    int *avg_qual = calloc((s->num_records+1), sizeof(int));
+    int *avg_qual = htscodecs_calloc((s->num_records+1), sizeof(int));
     if (!avg_qual)
         return;
 
+    if (one_param >= 0 || in_size > UINT_MAX)
+        stride = 1;
+    if (stride > 1 && htscodecs_hist8(in, in_size, qhist) < 0)
+        stride = 1;
+
+    // When sampling, qhist was gathered up front
+    uint32_t qhist_sampled[256] = {0};
+    uint32_t *qh_all = stride > 1 ? qhist_sampled : qhist;
+    size_t sampled = 0;
+
     rec = i = j = 0;
     while (i < in_size) {
         if (one_param >= 0 && (s->flags[rec] >> 16) != one_param) {
@@ -436,6 +486,23 @@ void fqz_qual_stats(fqz_slice *s,
             i += s->len[rec++];
             continue;
         }
+        if (stride > 1 && rec % stride && rec < s->num_records) {
+            // Not sampled, so just the average quality (if needed)
+            j = MIN(s->len[rec], in_size - i);
+            if (pm->do_qa != 0) {
+                uint32_t tot = 0;
+                size_t k;
+                for (k = 0; k < j; k++)
+                    tot += in[i+k];
+                tot = j ? (tot*10.0)/j+.5 : 0;
+                avg_qual[rec] = tot;
+                avg[MIN(2559, tot)]++;
+            }
+            last_len = j;
+            i += j;
+            rec++;
+            continue;
+        }
         if (rec < s->num_records) {
             j = s->len[rec];
             dir = s->flags[rec] & FQZ_FREAD2 ? 1 : 0;
@@ -452,9 +519,10 @@ void fqz_qual_stats(fqz_slice *s,
         uint64_t *th        = dir ? t2     : t1;
 
         uint32_t tot = 0;
+        sampled += MIN(j, in_size - i);
         for (; i < in_size && j > 0; i++, j--) {
             tot += in[i];
-            qhist[in[i]]++;
+            qh_all[in[i]]++;
             qhistb[j & (NP-1)][in[i]]++;
             qh[j & (NP-1)][in[i]]++;
             th[j & (NP-1)]++;
@@ -466,6 +534,9 @@ void fqz_qual_stats(fqz_slice *s,
 
         rec++;
     }
+    // Scale sampled counts up to the whole data set
+    double sample_scale = sampled ? (double)in_size / sampled : 1;
+    do_dedup *= sample_scale;
     pm->do_dedup = ((rec+1)/(do_dedup+1) < 500);
 
     last_len = 0;
@@ -637,8 +708,8 @@ void fqz_qual_stats(fqz_slice *s,
                     e2 -= qhist2[j][i] * log(qhist2[j][i] / (double)t2[j]);
             }
         }
-        e1 /= log(2)*8; // bytes
-        e2 /= log(2)*8;
+        e1 *= sample_scale / (log(2)*8); // bytes
+        e2 *= sample_scale / (log(2)*8);
 
         //fprintf(stderr, "read1/2 entropy merge %f split %f\n", e1, e2);
 
@@ -668,7 +739,15 @@ void fqz_qual_stats(fqz_slice *s,
         pm->max_sel = max_sel;
     }
 
-    free(avg_qual);
+    htscodecs_free(avg_qual);
+}
+
+void fqz_qual_stats(fqz_slice *s,
+                    unsigned char *in, size_t in_size,
+                    fqz_param *pm,
+                    uint32_t qhist[256],
+                    int one_param) {
+    fqz_qual_stats_sampled(s, in, in_size, pm, qhist, one_param, 1);
 }
 
 static inline
@@ -730,15 +809,9 @@ int fqz_store_parameters(fqz_gparams *gp, unsigned char *comp) {
     return comp_idx;
 }
 
-// Choose a set of parameters based on quality statistics and
-// some predefined options (selected via "strat").
-static inline
-int fqz_pick_parameters(fqz_gparams *gp,
-                        int vers,
-                        int strat,
-                        fqz_slice *s,
-                        unsigned char *in,
-                        size_t in_size) {
+// Fills out the qtab, ptab and dtab lookup tables from the context bits
+// and shifts in pm.
+static void fqz_build_tables(fqz_param *pm) {
     //approx sqrt(delta), must be sequential
     int dsqr[] = {
         0, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3,
@@ -746,16 +819,61 @@ int fqz_pick_parameters(fqz_gparams *gp,
         5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
         6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
     };
-    uint32_t qhist[256] = {0};
+    size_t i;
 
-    if (strat >= nstrats) strat = nstrats-1;
+    for (i = 0; i < sizeof(dsqr)/sizeof(*dsqr); i++)
+        if (dsqr[i] > (1<<pm->dbits)-1)
+            dsqr[i] = (1<<pm->dbits)-1;
+
+    // Produce ptab from pshift.
+    if (pm->qbits) {
+        for (i = 0; i < 256; i++) {
+            pm->qtab[i] = i; // 1:1
+
+            // Alternative mappings:
+            //qtab[i] = i > 30 ? MIN(max_sym,i)-15 : i/2;  // eg for 9827 BAM
+        }
+
+    }
+    pm->qmask = (1<<pm->qbits)-1;
+
+    if (pm->pbits) {
+        for (i = 0; i < 1024; i++)
+            pm->ptab[i] = MIN((1<<pm->pbits)-1, i>>pm->pshift);
+
+        // Alternatively via analysis of quality distributions we
+        // may select a bunch of positions that are special and
+        // have a non-uniform ptab[].
+        // Manual experimentation on a NovaSeq run saved 2.8% here.
+    }
+
+    if (pm->dbits) {
+        for (i = 0; i < 256; i++)
+            pm->dtab[i] = dsqr[MIN(sizeof(dsqr)/sizeof(*dsqr)-1, i>>pm->dshift)];
+    }
+}
+
+// Choose a set of parameters based on quality statistics and
+// some predefined options, in the format of a strat_opts[] row.
+// Unless "manual" is set, these options are then amended based on the
+// data.
+static
+int fqz_pick_parameters_opts(fqz_gparams *gp,
+                             int vers,
+                             const int *opts,
+                             int manual,
+                             int stride,
+                             fqz_slice *s,
+                             unsigned char *in,
+                             size_t in_size) {
+    uint32_t qhist[256] = {0};
 
     // Start with 1 set of parameters.
     // FIXME: add support for multiple params later.
     memset(gp, 0, sizeof(*gp));
     gp->vers = FQZ_VERS;
 
-    if (!(gp->p = calloc(1, sizeof(fqz_param))))
+    if (!(gp->p = htscodecs_calloc(1, sizeof(fqz_param))))
         return -1;
     gp->nparam = 1;
     gp->max_sel = 0;
@@ -767,20 +885,20 @@ int fqz_pick_parameters(fqz_gparams *gp,
 
     // Programmed strategies, which we then amend based on our
     // statistical analysis of the quality stream.
-    pm->qbits  = strat_opts[strat][0];
-    pm->qshift = strat_opts[strat][1];
-    pm->pbits  = strat_opts[strat][2];
-    pm->pshift = strat_opts[strat][3];
-    pm->dbits  = strat_opts[strat][4];
-    pm->dshift = strat_opts[strat][5];
-    pm->qloc   = strat_opts[strat][6];
-    pm->sloc   = strat_opts[strat][7];
-    pm->ploc   = strat_opts[strat][8];
-    pm->dloc   = strat_opts[strat][9];
+    pm->qbits  = opts[0];
+    pm->qshift = opts[1];
+    pm->pbits  = opts[2];
+    pm->pshift = opts[3];
+    pm->dbits  = opts[4];
+    pm->dshift = opts[5];
+    pm->qloc   = opts[6];
+    pm->sloc   = opts[7];
+    pm->ploc   = opts[8];
+    pm->dloc   = opts[9];
 
     // Params for controlling behaviour here.
-    pm->do_r2 = strat_opts[strat][10];
-    pm->do_qa = strat_opts[strat][11];
+    pm->do_r2 = opts[10];
+    pm->do_qa = opts[11];
 
     // Validity check input lengths and buffer size
     size_t tlen = 0, i;
@@ -795,7 +913,7 @@ int fqz_pick_parameters(fqz_gparams *gp,
         s->len[s->num_records-1] += in_size - tlen;
 
     // Quality metrics, for all recs
-    fqz_qual_stats(s, in, in_size, pm, qhist, -1);
+    fqz_qual_stats_sampled(s, in, in_size, pm, qhist, -1, stride);
 
     pm->store_qmap = (pm->nsym <= 8 && pm->nsym*2 < pm->max_sym);
 
@@ -808,7 +926,7 @@ int fqz_pick_parameters(fqz_gparams *gp,
     pm->fixed_len = (i == s->num_records);
     pm->use_qtab = 0; // unused by current encoder
 
-    if (strat >= nstrats-1)
+    if (manual)
         goto manually_set; // used in TEST_MAIN for debugging
 
     if (pm->pshift < 0)
@@ -842,10 +960,6 @@ int fqz_pick_parameters(fqz_gparams *gp,
 //          pm->qloc, pm->sloc, pm->ploc, pm->dloc,
 //          pm->do_r2, pm->do_qa);
 
-    for (i = 0; i < sizeof(dsqr)/sizeof(*dsqr); i++)
-        if (dsqr[i] > (1<<pm->dbits)-1)
-            dsqr[i] = (1<<pm->dbits)-1;
-
     if (pm->store_qmap) {
         int j;
         for (i = j = 0; i < 256; i++)
@@ -862,32 +976,7 @@ int fqz_pick_parameters(fqz_gparams *gp,
     if (gp->max_sym < pm->max_sym)
         gp->max_sym = pm->max_sym;
 
-    // Produce ptab from pshift.
-    if (pm->qbits) {
-        for (i = 0; i < 256; i++) {
-            pm->qtab[i] = i; // 1:1
-
-            // Alternative mappings:
-            //qtab[i] = i > 30 ? MIN(max_sym,i)-15 : i/2;  // eg for 9827 BAM
-        }
-
-    }
-    pm->qmask = (1<<pm->qbits)-1;
-
-    if (pm->pbits) {
-        for (i = 0; i < 1024; i++)
-            pm->ptab[i] = MIN((1<<pm->pbits)-1, i>>pm->pshift);
-
-        // Alternatively via analysis of quality distributions we
-        // may select a bunch of positions that are special and
-        // have a non-uniform ptab[].
-        // Manual experimentation on a NovaSeq run saved 2.8% here.
-    }
-
-    if (pm->dbits) {
-        for (i = 0; i < 256; i++)
-            pm->dtab[i] = dsqr[MIN(sizeof(dsqr)/sizeof(*dsqr)-1, i>>pm->dshift)];
-    }
+    fqz_build_tables(pm);
 
     pm->use_ptab = (pm->pbits > 0);
     pm->use_dtab = (pm->dbits > 0);
@@ -923,8 +1012,362 @@ int fqz_pick_parameters(fqz_gparams *gp,
     return 0;
 }
 
+// Choose a set of parameters using one of the predefined strategies.
+static inline
+int fqz_pick_parameters(fqz_gparams *gp,
+                        int vers,
+                        int strat,
+                        fqz_slice *s,
+                        unsigned char *in,
+                        size_t in_size) {
+    int stride = (strat >> FQZ_STRAT_SAMPLE_SHIFT) & 0xff;
+    strat &= 0xff;
+    if (strat >= nstrats) strat = nstrats-1;
+
+    return fqz_pick_parameters_opts(gp, vers, strat_opts[strat],
+                                    strat >= nstrats-1, stride,
+                                    s, in, in_size);
+}
+
 static void fqz_free_parameters(fqz_gparams *gp) {
-    if (gp && gp->p) free(gp->p);
+    if (gp && gp->p) htscodecs_free(gp->p);
+}
+
+void fqz_destroy_parameters(fqz_gparams *gp) {
+    fqz_free_parameters(gp);
+    if (gp)
+        gp->p = NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Automatic parameter tuning.
+ *
+ * Instead of a fixed strat_opts[] row, we search the allocation of the
+ * 16 context bits between the quality history, position and running
+ * delta, starting from the strategy 0 parameters and hill climbing one
+ * field at a time.
+ *
+ * Each candidate is scored by counting the (context, symbol) pairs over
+ * a sample of the records and estimating the cost of adaptively coding
+ * them.  We use the Krichevsky-Trofimov style estimator matching the
+ * SIMPLE_MODEL initial frequency of 1 and increment of STEP, which also
+ * accounts for the cost of learning sparse contexts and so penalises
+ * over-large models.  This is much cheaper than trial compression.
+ *
+ * The chosen options may be cached by a caller supplied key, typically
+ * the read group, so subsequent slices just need the usual statistics
+ * pass to pick the symbol maps and selectors.
+ */
+
+// Approximate number of quality values to sample when tuning
+#define FQZ_TUNE_SAMPLE 262144
+
+// Maximum hill climbing steps
+#define FQZ_TUNE_ITER 32
+
+struct fqz_tune_cache {
+    int n, size;
+    struct {
+        int key;
+        int opts[12];
+    } *ent;
+};
+
+fqz_tune_cache *fqz_tune_cache_create(void) {
+    return htscodecs_calloc(1, sizeof(fqz_tune_cache));
+}
+
+void fqz_tune_cache_destroy(fqz_tune_cache *c) {
+    if (!c)
+        return;
+    htscodecs_free(c->ent);
+    htscodecs_free(c);
+}
+
+static int *fqz_tune_cache_get(fqz_tune_cache *c, int key) {
+    int i;
+    for (i = 0; c && i < c->n; i++)
+        if (c->ent[i].key == key)
+            return c->ent[i].opts;
+    return NULL;
+}
+
+static void fqz_tune_cache_put(fqz_tune_cache *c, int key, int *opts) {
+    if (!c)
+        return;
+
+    if (c->n == c->size) {
+        int size = c->size ? c->size*2 : 16;
+        void *ent = htscodecs_realloc(c->ent, size * sizeof(*c->ent));
+        if (!ent)
+            return; // just not cached
+        c->ent = ent;
+        c->size = size;
+    }
+    c->ent[c->n].key = key;
+    memcpy(c->ent[c->n].opts, opts, sizeof(c->ent[c->n].opts));
+    c->n++;
+}
+
+typedef struct {
+    unsigned char *in;
+    size_t nrec;        // sampled records
+    size_t *off;        // in[] offset, length and selector per record
+    uint32_t *len, *sel;
+    size_t nsym;        // total sampled qualities
+    int max_len, sbits;
+
+    fqz_param *base;    // symbol map and flags from the initial pick
+
+    uint32_t *hkey, *hcnt, hmask;
+    uint32_t *ctot;     // per context totals
+    double *lg1, *lgK;  // log-gamma tables for the cost estimator
+} fqz_tune;
+
+static void fqz_tune_free(fqz_tune *t) {
+    htscodecs_free(t->off);
+    htscodecs_free(t->len);
+    htscodecs_free(t->sel);
+    htscodecs_free(t->hkey);
+    htscodecs_free(t->hcnt);
+    htscodecs_free(t->ctot);
+    htscodecs_free(t->lg1);
+    htscodecs_free(t->lgK);
+}
+
+// Picks the records to sample and allocates the counting tables.
+// This must follow a fqz_pick_parameters call, so selectors are present
+// in s->flags.
+static int fqz_tune_init(fqz_tune *t, fqz_gparams *gp, fqz_slice *s,
+                         unsigned char *in, size_t in_size, int stride) {
+    size_t i, rec, n = 0;
+
+    memset(t, 0, sizeof(*t));
+    t->in = in;
+    t->base = &gp->p[0];
+
+    size_t max_rec = s->num_records / stride + 1;
+    t->off = htscodecs_malloc(max_rec * sizeof(*t->off));
+    t->len = htscodecs_malloc(max_rec * sizeof(*t->len));
+    t->sel = htscodecs_malloc(max_rec * sizeof(*t->sel));
+    if (!t->off || !t->len || !t->sel)
+        return -1;
+
+    for (i = rec = 0; rec < s->num_records && i < in_size; rec++) {
+        uint32_t len = MIN(s->len[rec], in_size - i);
+        if (rec % stride == 0 && len) {
+            t->off[n] = i;
+            t->len[n] = len;
+            t->sel[n] = s->flags[rec] >> 16;
+            t->nsym += len;
+            if (t->max_len < len)
+                t->max_len = len;
+            n++;
+        }
+        i += len;
+    }
+    t->nrec = n;
+
+    int sel;
+    for (sel = gp->max_sel; sel; sel >>= 1)
+        t->sbits++;
+
+    uint32_t hsize = 65536;
+    while (hsize < 2*t->nsym && hsize < (1u<<31))
+        hsize *= 2;
+    t->hmask = hsize-1;
+    t->hkey = htscodecs_malloc(hsize * sizeof(*t->hkey));
+    t->hcnt = htscodecs_malloc(hsize * sizeof(*t->hcnt));
+    t->ctot = htscodecs_malloc(CTX_SIZE * sizeof(*t->ctot));
+    t->lg1  = htscodecs_malloc((t->nsym+1) * sizeof(*t->lg1));
+    t->lgK  = htscodecs_malloc((t->nsym+1) * sizeof(*t->lgK));
+    if (!t->hkey || !t->hcnt || !t->ctot || !t->lg1 || !t->lgK)
+        return -1;
+
+    // Cost of n symbols in a context, and of n occurrences of a symbol,
+    // in bits: log2 of Gamma(n+a)/Gamma(a) for a = K/STEP and 1/STEP.
+    double a1 = 1.0/STEP, aK = (gp->max_sym+1.0)/STEP;
+    double l1 = lgamma(a1), lK = lgamma(aK);
+    for (i = 0; i <= t->nsym; i++) {
+        t->lg1[i] = (lgamma(i+a1) - l1) / log(2);
+        t->lgK[i] = (lgamma(i+aK) - lK) / log(2);
+    }
+
+    return 0;
+}
+
+// Sets the context locations, returning -1 if the fields don't fit.
+static int fqz_tune_layout(fqz_tune *t, int *o) {
+    o[6] = 0;               // qloc
+    o[8] = o[0];            // ploc
+    o[9] = o[8] + o[2];     // dloc
+    o[7] = o[9] + o[4];     // sloc
+    if (o[7] + t->sbits > CTX_BITS)
+        return -1;
+
+    // Spread the read length over the position bits
+    int lbits = 0;
+    while ((1<<lbits) < MIN(t->max_len, 1024))
+        lbits++;
+    o[3] = MAX(0, lbits - o[2]);  // pshift
+
+    return 0;
+}
+
+// Returns the estimated encoded size in bytes of the sampled qualities
+// with the context parameters in o.
+static double fqz_tune_cost(fqz_tune *t, int *o) {
+    fqz_param pm = *t->base;
+    size_t i, r;
+
+    pm.qbits  = o[0]; pm.qshift = o[1];
+    pm.pbits  = o[2]; pm.pshift = o[3];
+    pm.dbits  = o[4]; pm.dshift = o[5];
+    pm.qloc   = o[6]; pm.sloc   = o[7];
+    pm.ploc   = o[8]; pm.dloc   = o[9];
+    pm.context = 0;
+    memset(pm.ptab, 0, sizeof(pm.ptab));
+    memset(pm.dtab, 0, sizeof(pm.dtab));
+    fqz_build_tables(&pm);
+
+    // As per compress_block_fqz2f
+    for (i = 0; i < 1024; i++)
+        pm.ptab[i] <<= pm.ploc;
+    for (i = 0; i < 256; i++)
+        pm.dtab[i] <<= pm.dloc;
+
+    memset(t->hkey, 0, (t->hmask+1) * sizeof(*t->hkey));
+    memset(t->ctot, 0, CTX_SIZE * sizeof(*t->ctot));
+
+    for (r = 0; r < t->nrec; r++) {
+        unsigned char *in = t->in + t->off[r];
+        fqz_state state = {0};
+        unsigned int last = pm.context;
+        state.p = t->len[r];
+        state.s = t->sel[r];
+
+        for (i = 0; i < t->len[r]; i++) {
+            unsigned int q = pm.qmap[in[i]];
+            uint32_t key = ((last << 8) | q) + 1;
+            uint32_t h = (key * 2654435761u) & t->hmask;
+            while (t->hkey[h] && t->hkey[h] != key)
+                h = (h+1) & t->hmask;
+            if (!t->hkey[h]) {
+                t->hkey[h] = key;
+                t->hcnt[h] = 0;
+            }
+            t->hcnt[h]++;
+            t->ctot[last]++;
+            last = fqz_update_ctx(&pm, &state, q);
+        }
+    }
+
+    double bits = 0;
+    for (i = 0; i <= t->hmask; i++)
+        if (t->hkey[i])
+            bits -= t->lg1[t->hcnt[i]];
+    for (i = 0; i < CTX_SIZE; i++)
+        bits += t->lgK[t->ctot[i]];
+
+    return bits / 8;
+}
+
+int fqz_tune_parameters(fqz_gparams *gp, int vers, fqz_slice *s,
+                        unsigned char *in, size_t in_size,
+                        fqz_tune_cache *cache, int key) {
+    int opts[12], *cached = key >= 0 ? fqz_tune_cache_get(cache, key) : NULL;
+    int stride = MAX(1, MIN(255, in_size / FQZ_TUNE_SAMPLE));
+
+    if (cached)
+        return fqz_pick_parameters_opts(gp, vers, cached, 1, stride,
+                                        s, in, in_size);
+
+    // Initial selectors and symbol map from strategy 0, but with an
+    // explicit quality average selector so the bit layout is left to us.
+    memcpy(opts, strat_opts[0], sizeof(opts));
+    opts[11] = 4;
+
+    if (s->num_records < 1 || in_size < 1000)
+        return fqz_pick_parameters_opts(gp, vers, opts, 0, 1,
+                                        s, in, in_size);
+
+    // The initial pick adds selectors to s->flags, so restore them
+    // before the final one.
+    uint32_t *flags = htscodecs_malloc(s->num_records * sizeof(*flags));
+    if (!flags)
+        return -1;
+    memcpy(flags, s->flags, s->num_records * sizeof(*flags));
+
+    fqz_gparams gp0;
+    fqz_tune t;
+    if (fqz_pick_parameters_opts(&gp0, vers, opts, 0, stride,
+                                 s, in, in_size) < 0) {
+        htscodecs_free(flags);
+        return -1;
+    }
+
+    if (fqz_tune_init(&t, &gp0, s, in, in_size, stride) < 0)
+        goto err;
+
+    fqz_param *pm = gp0.p;
+    opts[0] = pm->qbits; opts[1] = pm->qshift;
+    opts[2] = pm->pbits; opts[4] = pm->dbits; opts[5] = pm->dshift;
+    while (fqz_tune_layout(&t, opts) < 0) {
+        // Too many bits; take from the quality history first
+        if (opts[0] > 0) opts[0]--;
+        else if (opts[2] > 0) opts[2]--;
+        else if (opts[4] > 0) opts[4]--;
+        else goto err;
+    }
+    double best = fqz_tune_cost(&t, opts);
+
+    // Hill climb, adjusting one of qbits, qshift, pbits, dbits or
+    // dshift by +/-1 at a time.
+    static const int field[] = {0, 1, 2, 4, 5};
+    static const int lim[]   = {12, 8, 7, 3, 3};
+    int iter;
+    for (iter = 0; iter < FQZ_TUNE_ITER; iter++) {
+        int f, d, best_opts[12];
+        double step_best = best;
+        for (f = 0; f < sizeof(field)/sizeof(*field); f++) {
+            for (d = -1; d <= 1; d += 2) {
+                int o[12];
+                memcpy(o, opts, sizeof(o));
+                o[field[f]] += d;
+                if (o[field[f]] < (field[f] == 1) || o[field[f]] > lim[f])
+                    continue;
+                if (fqz_tune_layout(&t, o) < 0)
+                    continue;
+                double c = fqz_tune_cost(&t, o);
+                if (c < step_best) {
+                    step_best = c;
+                    memcpy(best_opts, o, sizeof(o));
+                }
+            }
+        }
+        if (step_best >= best * 0.999)
+            break;
+        best = step_best;
+        memcpy(opts, best_opts, sizeof(opts));
+    }
+
+    fqz_tune_free(&t);
+    fqz_free_parameters(&gp0);
+    memcpy(s->flags, flags, s->num_records * sizeof(*flags));
+    htscodecs_free(flags);
+
+    if (key >= 0)
+        fqz_tune_cache_put(cache, key, opts);
+
+    return fqz_pick_parameters_opts(gp, vers, opts, 1, stride,
+                                    s, in, in_size);
+
+ err:
+    fqz_tune_free(&t);
+    fqz_free_parameters(&gp0);
+    memcpy(s->flags, flags, s->num_records * sizeof(*flags));
+    htscodecs_free(flags);
+    return -1;
 }
 
 static int compress_new_read(fqz_slice *s,
@@ -1000,6 +1443,214 @@ static int compress_new_read(fqz_slice *s,
     return 0; // not dup
 }
 
+/*
+ * Independent segments (FQZ_VERS_SEG).
+ *
+ * The records are partitioned into consecutive segments which share the
+ * parameter blocks, but each have their own models and range coder.  This
+ * permits them to be encoded and decoded in parallel, at the cost of
+ * relearning the models per segment.
+ *
+ * Format, following the parameters:
+ *     u32v   number of segments
+ *     u32v   records, uncompressed size and compressed size, per segment
+ *     ...    segment data, each a separate range coder stream.
+ */
+typedef struct {
+    fqz_slice *s;
+    fqz_gparams *gp;
+    unsigned char *in;  // uncompressed data, segment or whole block
+    size_t in_size;
+    unsigned char *out; // compressed data, segment or whole block
+    size_t out_size;
+    ssize_t rec, nrec;  // record range
+    int *lengths;       // decoder only; record lengths for this segment
+    int nlengths;
+    int err;
+} fqz_seg;
+
+// Splits records into up to nseg parts of roughly equal size, filling out
+// seg[].rec, nrec, in and in_size.  Returns the number of segments.
+static int fqz_split_segs(fqz_slice *s, unsigned char *in, size_t in_size,
+                          fqz_seg *seg, int nseg) {
+    size_t off = 0;
+    ssize_t r;
+    int k = 0;
+
+    seg[0].rec = 0;
+    seg[0].in = in;
+    for (r = 0; r < s->num_records && k < nseg-1; r++) {
+        off += s->len[r];
+        if (off >= in_size)
+            break;
+        if (off * nseg >= (k+1) * in_size) {
+            k++;
+            seg[k].rec = r+1;
+            seg[k].in = in + off;
+        }
+    }
+    nseg = k+1;
+
+    for (k = 0; k < nseg; k++) {
+        seg[k].nrec = (k+1 < nseg ? seg[k+1].rec : s->num_records)
+            - seg[k].rec;
+        seg[k].in_size = (k+1 < nseg ? seg[k+1].in : in + in_size)
+            - seg[k].in;
+    }
+
+    return nseg;
+}
+
+// Encodes the remaining qualities in the current record, using the
+// NS symbol quality models in qual.
+//
+//     gcc    clang            gcc+fqz_qual_stats imp.
+// q40 5.033  5.026     -27%   4.137 -38%
+// q4  5.595            -15%   4.011 -36%
+// _Q  1.225            -11%   0.956
+//
+// Models have symbols sorted by frequency, so most common are at
+// start.  So while a model may be approx 1Kb, the first cache line is
+// a big win.
+#define FQZ_ENCODE_QUALS(NS, qual) do {                                 \
+        int j = -1;                                                     \
+                                                                        \
+        while (state.p >= 4 && i+j+4 < in_size) {                       \
+            int l1 = last, l2, l3, l4;                                  \
+            mm_prefetch(&qual[l1]);                                     \
+            unsigned char qm1 = pm->qmap[in[i + ++j]];                  \
+            last = fqz_update_ctx(pm, &state, qm1); l2 = last;          \
+                                                                        \
+            mm_prefetch(&qual[l2]);                                     \
+            unsigned char qm2 = pm->qmap[in[i + ++j]];                  \
+            last = fqz_update_ctx(pm, &state, qm2); l3 = last;          \
+                                                                        \
+            mm_prefetch(&qual[l3]);                                     \
+            unsigned char qm3 = pm->qmap[in[i + ++j]];                  \
+            last = fqz_update_ctx(pm, &state, qm3); l4 = last;          \
+                                                                        \
+            mm_prefetch(&qual[l4]);                                     \
+            unsigned char qm4 = pm->qmap[in[i + ++j]];                  \
+            last = fqz_update_ctx(pm, &state, qm4);                     \
+                                                                        \
+            SIMPLE_MODEL(NS,_encodeSymbol)(&qual[l1], &rc, qm1);        \
+            SIMPLE_MODEL(NS,_encodeSymbol)(&qual[l2], &rc, qm2);        \
+            SIMPLE_MODEL(NS,_encodeSymbol)(&qual[l3], &rc, qm3);        \
+            SIMPLE_MODEL(NS,_encodeSymbol)(&qual[l4], &rc, qm4);        \
+        }                                                               \
+                                                                        \
+        while (state.p > 0) {                                           \
+            int l2 = last;                                              \
+            mm_prefetch(&qual[last]);                                   \
+            unsigned char qm = pm->qmap[in[i + ++j]];                   \
+            last = fqz_update_ctx(pm, &state, qm);                      \
+            SIMPLE_MODEL(NS,_encodeSymbol)(&qual[l2], &rc, qm);         \
+        }                                                               \
+        i += j;                                                         \
+    } while (0)
+
+// Encodes the records in a single segment, or the entire block.
+// Returns 0 on success with seg->out_size set to the compressed size,
+//        -1 on failure.
+static int fqz_encode_seg(fqz_seg *seg) {
+    fqz_slice *s = seg->s;
+    fqz_gparams *gp = seg->gp;
+    unsigned char *in = seg->in;
+    size_t in_size = seg->in_size, i;
+    ssize_t rec_end = seg->rec + seg->nrec;
+    unsigned int last = 0;
+    RangeCoder rc;
+    int err = -1;
+
+    // Create models and initialise range coder
+    fqz_model model;
+    if (fqz_create_models(&model, gp) < 0)
+        return -1;
+
+    RC_SetOutput(&rc, (char *)seg->out);
+    RC_SetOutputEnd(&rc, (char *)seg->out + seg->out_size);
+    RC_StartEncode(&rc);
+
+    fqz_state state = {0};
+    fqz_param *pm = &gp->p[0];
+    state.p = 0;
+    state.first_len = 1;
+    state.last_len = 0;
+    state.rec = seg->rec;
+
+    for (i = 0; i < in_size; i++) {
+        if (state.p == 0) {
+            if (state.rec >= rec_end || s->len[state.rec] <= 0)
+                goto err;
+
+            if (compress_new_read(s, &state, gp, pm, &model, &rc,
+                                  in, &i, /*&rec,*/ &last))
+                continue;
+        }
+
+#if 0
+        //                        fqz_qual_stats imp.
+        // q40 6.876  6.852       5.96
+        // q4  6.566              5.07
+        // _Q  1.383              1.11
+        unsigned char q = in[i];
+        unsigned char qm = pm->qmap[q];
+
+        SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[last], &rc, qm);
+        last = fqz_update_ctx(pm, &state, qm);
+#else
+        if (model.qual_t)
+            FQZ_ENCODE_QUALS(QMAX_TINY, model.qual_t);
+        else if (model.qual_s)
+            FQZ_ENCODE_QUALS(QMAX_SMALL, model.qual_s);
+        else
+            FQZ_ENCODE_QUALS(QMAX, model.qual);
+#endif
+    }
+
+    if (RC_FinishEncode(&rc) < 0)
+        goto err;
+
+    seg->out_size = RC_OutSize(&rc);
+    err = 0;
+
+ err:
+    fqz_destroy_models(&model);
+    return err;
+}
+
+static void fqz_encode_seg_job(void *arg, int i) {
+    fqz_seg *seg = (fqz_seg *)arg;
+    seg[i].err = fqz_encode_seg(&seg[i]);
+}
+
+// Worst case output size for nrec records of in_size bytes, excluding
+// the header.
+//
+// Worst case scenario assuming random input data and no way to compress
+// is NBytes*growth for some small growth factor (arith_dynamic uses 1.05),
+// plus fixed overheads for the header / params.  Growth can be high
+// here as we're modelling things and pathological cases may trigger a
+// bad probability model.
+//
+// Per read is 4-byte len if not fixed length (but less if avg smaller)
+//             up to 1 byte for selection state (log2(max_sel) bits)
+//             1-bit for reverse flag
+//             1-bit for dup-last flag (but then no quals)
+// Per qual is 1-byte (assuming QMAX==256)
+//
+// => Total of (nrec*4.25 + in_size)*growth
+static size_t fqz_seg_bound(fqz_gparams *gp, size_t nrec, size_t in_size) {
+    int sel_bits = 0, sel = gp->max_sel;
+    while (sel) {
+        sel_bits++;
+        sel >>= 1;
+    }
+    double len_sz = gp->p[0].fixed_len ? 0.25 : 4.25;
+    len_sz += sel_bits / 8.0;
+    return (nrec*len_sz + in_size)*1.1;
+}
+
 static
 unsigned char *compress_block_fqz2f(int vers,
                                     int strat,
@@ -1007,16 +1658,17 @@ unsigned char *compress_block_fqz2f(int vers,
                                     unsigned char *in,
                                     size_t in_size,
                                     size_t *out_size,
-                                    fqz_gparams *gp) {
+                                    fqz_gparams *gp,
+                                    int nseg,
+                                    int nthreads) {
     fqz_gparams local_gp;
     int free_params = 0;
 
-    unsigned int last = 0;
     size_t i, j;
     ssize_t rec = 0;
 
     int comp_idx = 0;
-    RangeCoder rc;
+    fqz_seg seg1, *seg = &seg1;
 
     // Pick and store params
     if (!gp) {
@@ -1026,39 +1678,45 @@ unsigned char *compress_block_fqz2f(int vers,
         free_params = 1;
     }
 
-    // Worst case scenario assuming random input data and no way to compress
-    // is NBytes*growth for some small growth factor (arith_dynamic uses 1.05),
-    // plus fixed overheads for the header / params.  Growth can be high
-    // here as we're modelling things and pathological cases may trigger a
-    // bad probability model.
-    //
-    // Per read is 4-byte len if not fixed length (but less if avg smaller)
-    //             up to 1 byte for selection state (log2(max_sel) bits)
-    //             1-bit for reverse flag
-    //             1-bit for dup-last flag (but then no quals)
-    // Per qual is 1-byte (assuming QMAX==256)
-    //
-    // Header size is total guess, as depends on params, but it's almost
-    // always tiny, so a few K extra should be sufficient.
-    //
-    // => Total of (s->num_records*4.25 + in_size)*growth + hdr
-    int sel_bits = 0, sel = gp->max_sel;
-    while (sel) {
-        sel_bits++;
-        sel >>= 1;
+    if (nseg > 1 && s->num_records > 1) {
+        if (nseg > s->num_records)
+            nseg = s->num_records;
+        if (!(seg = htscodecs_calloc(nseg, sizeof(*seg)))) {
+            seg = &seg1;
+            nseg = 1;
+        } else {
+            nseg = fqz_split_segs(s, in, in_size, seg, nseg);
+        }
+    } else {
+        nseg = 1;
+    }
+    if (nseg == 1) {
+        memset(seg, 0, sizeof(*seg));
+        seg->in = in;
+        seg->in_size = in_size;
+        seg->nrec = s->num_records;
     }
-    double len_sz = gp->p[0].fixed_len ? 0.25 : 4.25;
-    len_sz += sel_bits / 8.0;
-    size_t comp_sz = (s->num_records*len_sz + in_size)*1.1 + 10000;
 
-    unsigned char *comp = (unsigned char *)malloc(comp_sz);
+    // Header size is total guess, as depends on params, but it's almost
+    // always tiny, so a few K extra should be sufficient.  Each segment
+    // also needs its own coder flush, first length and index entry.
+    size_t comp_sz = 10000 + (nseg > 1 ? 5 + nseg*15 : 0);
+    for (j = 0; j < nseg; j++)
+        comp_sz += fqz_seg_bound(gp, seg[j].nrec, seg[j].in_size)
+            + (nseg > 1 ? 100 : 0);
+
+    unsigned char *comp = (unsigned char *)htscodecs_malloc(comp_sz);
     unsigned char *compe = comp + (size_t)comp_sz;
     if (!comp)
-        return NULL;
+        goto err;
 
     //dump_params(gp);
     comp_idx = var_put_u32(comp, compe, in_size);
+    int param_idx = comp_idx;
     comp_idx += fqz_store_parameters(gp, comp+comp_idx);
+    if (nseg > 1)
+        // The version byte, first in the parameters, marks segmented data
+        comp[param_idx] = FQZ_VERS_SEG;
 
     fqz_param *pm;
 
@@ -1073,15 +1731,6 @@ unsigned char *compress_block_fqz2f(int vers,
             pm->dtab[i] <<= pm->dloc;
     }
 
-    // Create models and initialise range coder
-    fqz_model model;
-    if (fqz_create_models(&model, gp) < 0)
-        return NULL;
-
-    RC_SetOutput(&rc, (char *)comp+comp_idx);
-    RC_SetOutputEnd(&rc, (char *)comp+comp_sz);
-    RC_StartEncode(&rc);
-
     // For CRAM3.1, reverse upfront if needed
     pm = &gp->p[0];
     if (gp->gflags & GFLAG_DO_REV) {
@@ -1108,90 +1757,49 @@ unsigned char *compress_block_fqz2f(int vers,
         rec = 0;
     }
 
-    fqz_state state = {0};
-    pm = &gp->p[0];
-    state.p = 0;
-    state.first_len = 1;
-    state.last_len = 0;
-    state.rec = rec;
+    // Encode the segments, leaving room for the index ahead of them.
+    // They're packed together afterwards.
+    size_t seg_idx = comp_idx + (nseg > 1 ? 5 + nseg*15 : 0);
+    for (j = 0; j < nseg; j++) {
+        seg[j].s = s;
+        seg[j].gp = gp;
+        seg[j].out = comp + seg_idx;
+        seg[j].out_size = nseg > 1
+            ? fqz_seg_bound(gp, seg[j].nrec, seg[j].in_size) + 100
+            : compe - seg[j].out;
+        seg_idx += seg[j].out_size;
+    }
 
-    for (i = 0; i < in_size; i++) {
-        if (state.p == 0) {
-            if (state.rec >= s->num_records || s->len[state.rec] <= 0) {
-                free(comp);
-                comp = NULL;
-                goto err;
-            }
+    htscodecs_par_run(nthreads, fqz_encode_seg_job, seg, nseg);
 
-            if (compress_new_read(s, &state, gp, pm, &model, &rc,
-                                  in, &i, /*&rec,*/ &last))
-                continue;
+    for (j = 0; j < nseg; j++) {
+        if (seg[j].err) {
+            htscodecs_free(comp);
+            comp = NULL;
+            *out_size = 0;
+            goto undo;
         }
+    }
 
-#if 0
-        //                        fqz_qual_stats imp.
-        // q40 6.876  6.852       5.96
-        // q4  6.566              5.07
-        // _Q  1.383              1.11
-        unsigned char q = in[i];
-        unsigned char qm = pm->qmap[q];
-
-        SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[last], &rc, qm);
-        last = fqz_update_ctx(pm, &state, qm);
-#else
-        //     gcc    clang            gcc+fqz_qual_stats imp.
-        // q40 5.033  5.026     -27%   4.137 -38%
-        // q4  5.595            -15%   4.011 -36%
-        // _Q  1.225            -11%   0.956
-        int j = -1;
-
-        while (state.p >= 4 && i+j+4 < in_size) {
-            int l1 = last, l2, l3, l4;
-            // Model has symbols sorted by frequency, so most common are at
-            // start.  So while model is approx 1Kb, the first cache line is
-            // a big win.
-            mm_prefetch(&model.qual[l1]);
-            unsigned char qm1 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm1); l2 = last;
-
-            mm_prefetch(&model.qual[l2]);
-            unsigned char qm2 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm2); l3 = last;
-
-            mm_prefetch(&model.qual[l3]);
-            unsigned char qm3 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm3); l4 = last;
-
-            mm_prefetch(&model.qual[l4]);
-            unsigned char qm4 = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm4);
-
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l1], &rc, qm1);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l2], &rc, qm2);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l3], &rc, qm3);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l4], &rc, qm4);
+    if (nseg > 1) {
+        comp_idx += var_put_u32(comp+comp_idx, compe, nseg);
+        for (j = 0; j < nseg; j++) {
+            comp_idx += var_put_u32(comp+comp_idx, compe, seg[j].nrec);
+            comp_idx += var_put_u32(comp+comp_idx, compe, seg[j].in_size);
+            comp_idx += var_put_u32(comp+comp_idx, compe, seg[j].out_size);
         }
-
-        while (state.p > 0) {
-            int l2 = last;
-            mm_prefetch(&model.qual[last]);
-            unsigned char qm = pm->qmap[in[i + ++j]];
-            last = fqz_update_ctx(pm, &state, qm);
-            SIMPLE_MODEL(QMAX,_encodeSymbol)(&model.qual[l2], &rc, qm);
+        for (j = 0; j < nseg; j++) {
+            memmove(comp+comp_idx, seg[j].out, seg[j].out_size);
+            comp_idx += seg[j].out_size;
         }
-        i += j;
-#endif
-    }
-
-    if (RC_FinishEncode(&rc) < 0) {
-        free(comp);
-        comp = NULL;
-        *out_size = 0;
-        goto err;
+        *out_size = comp_idx;
+    } else {
+        *out_size = comp_idx + seg->out_size;
     }
+    //fprintf(stderr, "%d -> %d\n", (int)in_size, (int)*out_size);
 
+ undo:
     // For CRAM3.1, undo our earlier reversal step
-    rec = state.rec;
     if (gp->gflags & GFLAG_DO_REV) {
         i = rec = j = 0;
         while (i < in_size) {
@@ -1220,11 +1828,9 @@ unsigned char *compress_block_fqz2f(int vers,
     for (rec = 0; rec < s->num_records; rec++)
         s->flags[rec] &= 0xffff;
 
-    *out_size = comp_idx + RC_OutSize(&rc);
-    //fprintf(stderr, "%d -> %d\n", (int)in_size, (int)*out_size);
-
  err:
-    fqz_destroy_models(&model);
+    if (seg != &seg1)
+        htscodecs_free(seg);
     if (free_params)
         fqz_free_parameters(gp);
 
@@ -1326,7 +1932,7 @@ int fqz_read_parameters(fqz_gparams *gp, unsigned char *in, size_t in_size) {
 
     // Format version
     gp->vers = in[in_idx++];
-    if (gp->vers != FQZ_VERS)
+    if (gp->vers != FQZ_VERS && gp->vers != FQZ_VERS_SEG)
         return -1;
 
     // Global glags
@@ -1352,7 +1958,7 @@ int fqz_read_parameters(fqz_gparams *gp, unsigned char *in, size_t in_size) {
     }
 
     // Load the individual parameter locks
-    if (!(gp->p = malloc(gp->nparam * sizeof(*gp->p))))
+    if (!(gp->p = htscodecs_malloc(gp->nparam * sizeof(*gp->p))))
         return -1;
 
     gp->max_sym = 0;
@@ -1377,6 +1983,16 @@ int fqz_read_parameters(fqz_gparams *gp, unsigned char *in, size_t in_size) {
     return -1;
 }
 
+// Decodes the remaining qualities in the current record, using the
+// NS symbol quality models in qual.
+#define FQZ_DECODE_QUALS(NS, qual) do {                                 \
+        unsigned char Q = SIMPLE_MODEL(NS,_decodeSymbol)                \
+            (&qual[last], &rc);                                         \
+                                                                        \
+        last = fqz_update_ctx(pm, &state, Q);                           \
+        uncomp[i++] = pm->qmap[Q];                                      \
+    } while (state.p != 0 && i < len)
+
 // Handles the state.p==0 section of uncompress_block_fqz2f
 static int decompress_new_read(fqz_slice *s,
                                fqz_state *state,
@@ -1452,66 +2068,34 @@ static int decompress_new_read(fqz_slice *s,
 }
 
 
-static
-unsigned char *uncompress_block_fqz2f(fqz_slice *s,
-                                      unsigned char *in,
-                                      size_t in_size,
-                                      size_t *out_size,
-                                      int *lengths,
-                                      int nlengths) {
-    fqz_gparams gp;
+// Decodes a single segment, or the entire block, from seg->in into
+// seg->out.  seg->nrec, if not -1, is the expected number of records.
+// Returns 0 on success with seg->nrec set to the number of records,
+//        -1 on failure.
+static int fqz_decode_seg(fqz_seg *seg) {
+    fqz_gparams *gp = seg->gp;
     fqz_param *pm;
+    unsigned char *uncomp = seg->out;
+    size_t len = seg->out_size;
     char *rev_a = NULL;
     int *len_a = NULL;
-    memset(&gp, 0, sizeof(gp));
-
-    uint32_t len;
-    ssize_t i, rec = 0, in_idx;
-    in_idx = var_get_u32(in, in+in_size, &len);
-    *out_size = len;
-
-#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
-    if (len > 100000)
-        return NULL;
-#endif
-
-    unsigned char *uncomp = NULL;
+    ssize_t i, rec = 0;
     RangeCoder rc;
     unsigned int last = 0;
-
-    // Decode parameter blocks
-    if ((i = fqz_read_parameters(&gp, in+in_idx, in_size-in_idx)) < 0)
-        return NULL;
-    //dump_params(&gp);
-    in_idx += i;
-
-    // Optimisations to remove shifts from main loop
-    for (i = 0; i < gp.nparam; i++) {
-        int j;
-        pm = &gp.p[i];
-        for (j = 0; j < 1024; j++)
-            pm->ptab[j] <<= pm->ploc;
-        for (j = 0; j < 256; j++)
-            pm->dtab[j] <<= pm->dloc;
-    }
+    int err = -1;
 
     // Initialise models and entropy coder
     fqz_model model;
-    if (fqz_create_models(&model, &gp) < 0)
-        return NULL;
+    if (fqz_create_models(&model, gp) < 0)
+        return -1;
 
-    RC_SetInput(&rc, (char *)in+in_idx, (char *)in+in_size);
+    RC_SetInput(&rc, (char *)seg->in, (char *)seg->in+seg->in_size);
     RC_StartDecode(&rc);
 
-
     // Allocate buffers
-    uncomp = (unsigned char *)malloc(*out_size);
-    if (!uncomp)
-        goto err;
-
     int nrec = 1000;
-    rev_a = malloc(nrec);
-    len_a = malloc(nrec * sizeof(int));
+    rev_a = htscodecs_malloc(nrec);
+    len_a = htscodecs_malloc(nrec * sizeof(int));
     if (!rev_a || !len_a)
         goto err;
 
@@ -1529,21 +2113,21 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
 
     int rev = 0;
     int x = 0;
-    pm = &gp.p[x];
+    pm = &gp->p[x];
     for (i = 0; i < len; ) {
         if (state.rec >= nrec) {
             nrec *= 2;
-            rev_a = realloc(rev_a, nrec);
-            len_a = realloc(len_a, nrec*sizeof(int));
+            rev_a = htscodecs_realloc(rev_a, nrec);
+            len_a = htscodecs_realloc(len_a, nrec*sizeof(int));
             if (!rev_a || !len_a)
                 goto err;
         }
 
         if (state.p == 0) {
-            int r = decompress_new_read(s, &state, &gp, pm, &model, &rc,
-                                        in, &i, uncomp, out_size,
+            int r = decompress_new_read(NULL, &state, gp, pm, &model, &rc,
+                                        seg->in, &i, uncomp, &len,
                                         &rev, rev_a, len_a,
-                                        lengths, nlengths);
+                                        seg->lengths, seg->nlengths);
             if (r < 0)
                 goto err;
             if (r > 0)
@@ -1552,27 +2136,26 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
         }
 
         // Decode and update context
-        do {
-            unsigned char Q = SIMPLE_MODEL(QMAX,_decodeSymbol)
-                (&model.qual[last], &rc);
-
-            last = fqz_update_ctx(pm, &state, Q);
-            uncomp[i++] = pm->qmap[Q];
-        } while (state.p != 0 && i < len);
+        if (model.qual_t)
+            FQZ_DECODE_QUALS(QMAX_TINY, model.qual_t);
+        else if (model.qual_s)
+            FQZ_DECODE_QUALS(QMAX_SMALL, model.qual_s);
+        else
+            FQZ_DECODE_QUALS(QMAX, model.qual);
     }
 
     rec = state.rec;
     if (rec >= nrec) {
         nrec *= 2;
-        rev_a = realloc(rev_a, nrec);
-        len_a = realloc(len_a, nrec*sizeof(int));
+        rev_a = htscodecs_realloc(rev_a, nrec);
+        len_a = htscodecs_realloc(len_a, nrec*sizeof(int));
         if (!rev_a || !len_a)
             goto err;
     }
     rev_a[rec] = rev;
     len_a[rec] = len;
 
-    if (gp.gflags & GFLAG_DO_REV) {
+    if (gp->gflags & GFLAG_DO_REV) {
         for (i = rec = 0; i < len && rec < nrec; i += len_a[rec++]) {
             if (!rev_a[rec])
                 continue;
@@ -1591,9 +2174,133 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
     if (RC_FinishDecode(&rc) < 0)
         goto err;
 
+    if (seg->nrec >= 0 && seg->nrec != state.rec)
+        goto err;
+    seg->nrec = state.rec;
+    err = 0;
+
+ err:
     fqz_destroy_models(&model);
-    free(rev_a);
-    free(len_a);
+    htscodecs_free(rev_a);
+    htscodecs_free(len_a);
+
+    return err;
+}
+
+static void fqz_decode_seg_job(void *arg, int i) {
+    fqz_seg *seg = (fqz_seg *)arg;
+    seg[i].err = fqz_decode_seg(&seg[i]);
+}
+
+static
+unsigned char *uncompress_block_fqz2f(fqz_slice *s,
+                                      unsigned char *in,
+                                      size_t in_size,
+                                      size_t *out_size,
+                                      int *lengths,
+                                      int nlengths,
+                                      int nthreads) {
+    fqz_gparams gp;
+    fqz_param *pm;
+    fqz_seg seg1, *seg = &seg1;
+    int nseg = 1;
+    memset(&gp, 0, sizeof(gp));
+
+    uint32_t len;
+    ssize_t i, rec = 0, in_idx;
+    in_idx = var_get_u32(in, in+in_size, &len);
+    *out_size = len;
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (len > 100000)
+        return NULL;
+#endif
+
+    unsigned char *uncomp = NULL;
+
+    // Decode parameter blocks
+    if ((i = fqz_read_parameters(&gp, in+in_idx, in_size-in_idx)) < 0)
+        return NULL;
+    //dump_params(&gp);
+    in_idx += i;
+
+    // Optimisations to remove shifts from main loop
+    for (i = 0; i < gp.nparam; i++) {
+        int j;
+        pm = &gp.p[i];
+        for (j = 0; j < 1024; j++)
+            pm->ptab[j] <<= pm->ploc;
+        for (j = 0; j < 256; j++)
+            pm->dtab[j] <<= pm->dloc;
+    }
+
+    // Allocate buffers
+    uncomp = (unsigned char *)htscodecs_malloc(*out_size);
+    if (!uncomp)
+        goto err;
+
+    if (gp.vers == FQZ_VERS_SEG) {
+        // Segment index.  Each entry is at least 3 bytes.
+        uint32_t n, nr, us, cs;
+        in_idx += var_get_u32(in+in_idx, in+in_size, &n);
+        if (n < 1 || n > (in_size - in_idx) / 3)
+            goto err;
+        if (!(seg = htscodecs_calloc(n, sizeof(*seg)))) {
+            seg = &seg1;
+            goto err;
+        }
+        nseg = n;
+
+        uint64_t uoff = 0, coff = 0;
+        for (i = 0; i < nseg; i++) {
+            in_idx += var_get_u32(in+in_idx, in+in_size, &nr);
+            in_idx += var_get_u32(in+in_idx, in+in_size, &us);
+            in_idx += var_get_u32(in+in_idx, in+in_size, &cs);
+            seg[i].nrec = nr;
+            seg[i].out = uncomp + uoff;
+            seg[i].out_size = us;
+            seg[i].in_size = cs;
+            if (lengths && rec < nlengths) {
+                seg[i].lengths = lengths + rec;
+                seg[i].nlengths = nlengths - rec;
+            }
+            rec += nr;
+            uoff += us;
+            coff += cs;
+            if (uoff > len)
+                goto err;
+        }
+        if (uoff != len || coff > in_size - in_idx)
+            goto err;
+
+        for (i = 0; i < nseg; i++) {
+            seg[i].in = in + in_idx;
+            in_idx += seg[i].in_size;
+        }
+    } else {
+        memset(seg, 0, sizeof(*seg));
+        seg->in = in + in_idx;
+        seg->in_size = in_size - in_idx;
+        seg->out = uncomp;
+        seg->out_size = len;
+        seg->nrec = -1;
+        seg->lengths = lengths;
+        seg->nlengths = nlengths;
+    }
+
+    for (i = 0; i < nseg; i++)
+        seg[i].gp = &gp;
+
+    htscodecs_par_run(nthreads, fqz_decode_seg_job, seg, nseg);
+
+    for (i = rec = 0; i < nseg; i++) {
+        if (seg[i].err)
+            goto err;
+        rec += seg[i].nrec;
+    }
+
+    if (seg != &seg1)
+        htscodecs_free(seg);
     fqz_free_parameters(&gp);
 
 #ifdef TEST_MAIN
@@ -1603,28 +2310,41 @@ unsigned char *uncompress_block_fqz2f(fqz_slice *s,
     return uncomp;
 
  err:
-    fqz_destroy_models(&model);
-    free(rev_a);
-    free(len_a);
+    if (seg != &seg1)
+        htscodecs_free(seg);
     fqz_free_parameters(&gp);
-    free(uncomp);
+    htscodecs_free(uncomp);
 
     return NULL;
 }
 
 char *fqz_compress(int vers, fqz_slice *s, char *in, size_t uncomp_size,
                    size_t *comp_size, int strat, fqz_gparams *gp) {
+    return fqz_compress_mt(vers, s, in, uncomp_size, comp_size, strat, gp,
+                           1, 1);
+}
+
+char *fqz_compress_mt(int vers, fqz_slice *s, char *in, size_t uncomp_size,
+                      size_t *comp_size, int strat, fqz_gparams *gp,
+                      int nseg, int nthreads) {
     if (uncomp_size > INT_MAX) {
         *comp_size = 0;
         return NULL;
     }
 
     return (char *)compress_block_fqz2f(vers, strat, s, (unsigned char *)in,
-                                        uncomp_size, comp_size, gp);
+                                        uncomp_size, comp_size, gp,
+                                        nseg, nthreads);
 }
 
 char *fqz_decompress(char *in, size_t comp_size, size_t *uncomp_size,
                      int *lengths, int nlengths) {
+    return fqz_decompress_mt(in, comp_size, uncomp_size, lengths, nlengths, 1);
+}
+
+char *fqz_decompress_mt(char *in, size_t comp_size, size_t *uncomp_size,
+                        int *lengths, int nlengths, int nthreads) {
     return (char *)uncompress_block_fqz2f(NULL, (unsigned char *)in,
-                                          comp_size, uncomp_size, lengths, nlengths);
+                                          comp_size, uncomp_size,
+                                          lengths, nlengths, nthreads);
 }
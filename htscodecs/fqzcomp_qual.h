@@ -47,8 +47,25 @@ extern "C" {
 /* Current FQZ format version */
 #define FQZ_VERS 5
 
+/*
+ * Format version used when the records are split into independent
+ * segments by fqz_compress_mt.  This is not part of the CRAM 3.1 format,
+ * and should only be used when the reader is known to be this library.
+ */
+#define FQZ_VERS_SEG 6
+
 #define FQZ_MAX_STRAT 3
 
+/*
+ * Sampled parameter selection, ORed into the fqz_compress strat argument.
+ * Bits 8-15 hold N, to analyse only every Nth record when picking the
+ * parameters; 0 or 1 analyses all records.  Higher N is faster, but the
+ * parameters chosen may compress less well.  The output remains
+ * decodable by any FQZ_VERS decoder.
+ */
+#define FQZ_STRAT_SAMPLE_SHIFT 8
+#define FQZ_STRAT_SAMPLE(n) ((n) << FQZ_STRAT_SAMPLE_SHIFT)
+
 /*
  * Minimal per-record information taken from a cram slice.
  *
@@ -143,7 +160,8 @@ typedef struct {
  * @param in            Buffer of concatenated quality values (no separator)
  * @param in_size       Size of in buffer
  * @param out_size      Size of returned output
- * @param strat         FQZ compression strategy (0 to FQZ_MAX_STRAT)
+ * @param strat         FQZ compression strategy (0 to FQZ_MAX_STRAT),
+ *                      optionally ORed with FQZ_STRAT_SAMPLE(n)
  * @param gp            Optional fqzcomp paramters (may be NULL).
  *
  * @return              The compressed quality buffer on success,
@@ -166,6 +184,31 @@ char *fqz_compress(int vers, fqz_slice *s, char *in, size_t in_size,
 char *fqz_decompress(char *in, size_t in_size, size_t *out_size,
                      int *lengths, int nlengths);
 
+/** Compress a block of quality values in parallel.
+ *
+ * As fqz_compress, but the records are partitioned into up to nseg
+ * consecutive segments of similar size which share the same parameters
+ * but are otherwise encoded independently, using up to nthreads threads.
+ * More segments permit more parallelism in both encoding and decoding,
+ * but each one has to relearn the quality models from scratch, so small
+ * segments (under a few hundred KB) will harm the compression ratio.
+ *
+ * With nseg <= 1 this is identical to fqz_compress.  Otherwise the output
+ * uses format version FQZ_VERS_SEG.
+ */
+char *fqz_compress_mt(int vers, fqz_slice *s, char *in, size_t in_size,
+                      size_t *out_size, int strat, fqz_gparams *gp,
+                      int nseg, int nthreads);
+
+/** Decompress a block of quality values in parallel.
+ *
+ * As fqz_decompress, but FQZ_VERS_SEG data is decoded using up to
+ * nthreads threads.  Note fqz_decompress also decodes such data, but
+ * serially.
+ */
+char *fqz_decompress_mt(char *in, size_t in_size, size_t *out_size,
+                        int *lengths, int nlengths, int nthreads);
+
 /** A utlity function to analyse a quality buffer to gather statistical
  *  information.  This is written into qhist and pm.  This function is only
  *  useful if you intend on passing your own fqz_gparams block to
@@ -177,6 +220,35 @@ void fqz_qual_stats(fqz_slice *s,
                     uint32_t qhist[256],
                     int one_param);
 
+/** Automatically choose fqzcomp parameters for a block of qualities.
+ *
+ * Rather than using one of the fixed strategies, this searches the
+ * allocation of context bits between quality history, position and
+ * delta using a fast estimate of the model cost on a sample of the
+ * records.  The result is written to gp, suitable for passing to
+ * fqz_compress.  As fqz_compress modifies the parameters, gp must be
+ * retuned (or fetched from the cache) for each call, and freed
+ * afterwards with fqz_destroy_parameters.
+ *
+ * If cache is non-NULL and key >= 0 (e.g. a read group number), the
+ * chosen context layout is remembered and subsequent calls with the
+ * same key skip the search.  The cache is not thread safe.
+ *
+ * @return              0 on success,
+ *                      -1 on failure.
+ */
+typedef struct fqz_tune_cache fqz_tune_cache;
+
+fqz_tune_cache *fqz_tune_cache_create(void);
+void fqz_tune_cache_destroy(fqz_tune_cache *c);
+
+int fqz_tune_parameters(fqz_gparams *gp, int vers, fqz_slice *s,
+                        unsigned char *in, size_t in_size,
+                        fqz_tune_cache *cache, int key);
+
+/** Frees parameters created by fqz_tune_parameters. */
+void fqz_destroy_parameters(fqz_gparams *gp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,10 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
 #include "htscodecs.h"
 #include "version.h"
 
@@ -42,3 +46,52 @@
 const char *htscodecs_version(void) {
     return HTSCODECS_VERSION_TEXT;
 }
+
+// The active allocator, or all NULL for the C library
+static htscodecs_allocator hts_alloc;
+
+int htscodecs_set_allocator(const htscodecs_allocator *a) {
+    if (!a) {
+        memset(&hts_alloc, 0, sizeof(hts_alloc));
+        return 0;
+    }
+
+    if (!a->malloc_fn || !a->realloc_fn || !a->free_fn)
+        return -1;
+
+    hts_alloc = *a;
+    return 0;
+}
+
+void *htscodecs_malloc(size_t size) {
+    if (hts_alloc.malloc_fn)
+        return hts_alloc.malloc_fn(hts_alloc.arg, size);
+    return malloc(size);
+}
+
+void *htscodecs_calloc(size_t nmemb, size_t size) {
+    if (hts_alloc.calloc_fn)
+        return hts_alloc.calloc_fn(hts_alloc.arg, nmemb, size);
+    if (!hts_alloc.malloc_fn)
+        return calloc(nmemb, size);
+
+    if (size && nmemb > SIZE_MAX / size)
+        return NULL;
+    void *ptr = hts_alloc.malloc_fn(hts_alloc.arg, nmemb * size);
+    if (ptr)
+        memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void *htscodecs_realloc(void *ptr, size_t size) {
+    if (hts_alloc.realloc_fn)
+        return hts_alloc.realloc_fn(hts_alloc.arg, ptr, size);
+    return realloc(ptr, size);
+}
+
+void htscodecs_free(void *ptr) {
+    if (hts_alloc.free_fn)
+        hts_alloc.free_fn(hts_alloc.arg, ptr);
+    else
+        free(ptr);
+}
@@ -34,6 +34,12 @@
 #ifndef HTSCODECS_H
 #define HTSCODECS_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * Version X.Y.Z encoded as XYYYZZ.
  * We mainly increment X and Y.  Z *may* get bumped in between official
@@ -52,4 +58,41 @@
  */
 const char *htscodecs_version(void);
 
+/*
+ * Memory allocation hooks.
+ *
+ * By default all memory is obtained from the C library malloc family.
+ * htscodecs_set_allocator replaces this for every codec in the library,
+ * eg to use NUMA local or per-thread arenas, or to measure usage.  The
+ * arg field is passed to each function.  calloc_fn may be NULL, in which
+ * case malloc_fn and memset are used.  Passing NULL restores the C
+ * library functions.
+ *
+ * Memory must be freed by the allocator that allocated it, so this
+ * should be called before any other htscodecs function and not while
+ * other threads are using the library.  This includes the buffers
+ * returned by the compression and decompression functions, which should
+ * be released using htscodecs_free.
+ *
+ * Returns 0 on success, -1 if malloc_fn, realloc_fn or free_fn is NULL.
+ */
+typedef struct {
+    void *(*malloc_fn) (void *arg, size_t size);
+    void *(*calloc_fn) (void *arg, size_t nmemb, size_t size);
+    void *(*realloc_fn)(void *arg, void *ptr, size_t size);
+    void  (*free_fn)   (void *arg, void *ptr);
+    void *arg;
+} htscodecs_allocator;
+
+int htscodecs_set_allocator(const htscodecs_allocator *a);
+
+void *htscodecs_malloc(size_t size);
+void *htscodecs_calloc(size_t nmemb, size_t size);
+void *htscodecs_realloc(void *ptr, size_t size);
+void  htscodecs_free(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* HTSCODECS_H */
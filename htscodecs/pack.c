@@ -39,6 +39,7 @@
 #include <stdio.h>
 
 #include "pack.h"
+#include "htscodecs.h"
 
 //-----------------------------------------------------------------------------
 
@@ -55,6 +56,17 @@
  */
 uint8_t *hts_pack(uint8_t *data, int64_t len,
                   uint8_t *out_meta, int *out_meta_len, uint64_t *out_len) {
+    return hts_pack_to(data, len, out_meta, out_meta_len, NULL, out_len);
+}
+
+/*
+ * As hts_pack, but the packed data is written to a preallocated "out"
+ * buffer of at least len+1 bytes.  If out is NULL it is allocated, as
+ * with hts_pack.
+ */
+uint8_t *hts_pack_to(uint8_t *data, int64_t len,
+                     uint8_t *out_meta, int *out_meta_len,
+                     uint8_t *out, uint64_t *out_len) {
     int p[256] = {0}, n;
     uint64_t i, j;
 
@@ -75,8 +87,7 @@ uint8_t *hts_pack(uint8_t *data, int64_t len,
     if (n > 16)
         return NULL;
 
-    uint8_t *out = malloc(len+1);
-    if (!out)
+    if (!out && !(out = htscodecs_malloc(len+1)))
         return NULL;
 
     // Work out how many values per byte to encode.
@@ -52,6 +52,15 @@ extern "C" {
 uint8_t *hts_pack(uint8_t *data, int64_t len,
                   uint8_t *out_meta, int *out_meta_len, uint64_t *out_len);
 
+/*
+ * As hts_pack, but the packed data is written to a preallocated "out"
+ * buffer of at least len+1 bytes.  If out is NULL it is allocated, as
+ * with hts_pack.
+ */
+uint8_t *hts_pack_to(uint8_t *data, int64_t len,
+                     uint8_t *out_meta, int *out_meta_len,
+                     uint8_t *out, uint64_t *out_len);
+
 /*
  * Unpacks the meta-data portions of the hts_pack algorithm.
  * This consists of the count of symbols and their values.
@@ -42,6 +42,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "htscodecs.h"
+
 /*
  * Implements a pooled block allocator where all items are the same size,
  * but we need many of them.
@@ -53,7 +55,8 @@ typedef struct {
 
 typedef struct {
     size_t dsize;
-    size_t npools;
+    size_t npools;  // pools in use
+    size_t apools;  // pools allocated; see pool_reset
     pool_t *pools;
     void *free;
 } pool_alloc_t;
@@ -63,7 +66,7 @@ typedef struct {
 static pool_alloc_t *pool_create(size_t dsize) {
     pool_alloc_t *p;
 
-    if (NULL == (p = (pool_alloc_t *)malloc(sizeof(*p))))
+    if (NULL == (p = (pool_alloc_t *)htscodecs_malloc(sizeof(*p))))
         return NULL;
 
     /* Minimum size is a pointer, for free list */
@@ -73,6 +76,7 @@ static pool_alloc_t *pool_create(size_t dsize) {
     p->dsize = dsize;
 
     p->npools = 0;
+    p->apools = 0;
     p->pools = NULL;
     p->free  = NULL;
 
@@ -82,18 +86,26 @@ static pool_alloc_t *pool_create(size_t dsize) {
 static pool_t *new_pool(pool_alloc_t *p) {
     size_t n = PSIZE / p->dsize;
     pool_t *pool;
-    
-    pool = realloc(p->pools, (p->npools + 1) * sizeof(*p->pools));
+
+    if (p->npools < p->apools) {
+        // Reuse a pool kept by pool_reset
+        pool = &p->pools[p->npools++];
+        pool->used = 0;
+        return pool;
+    }
+
+    pool = htscodecs_realloc(p->pools, (p->npools + 1) * sizeof(*p->pools));
     if (NULL == pool) return NULL;
     p->pools = pool;
     pool = &p->pools[p->npools];
 
-    pool->pool = malloc(n * p->dsize);
+    pool->pool = htscodecs_malloc(n * p->dsize);
     if (NULL == pool->pool) return NULL;
 
     pool->used = 0;
 
     p->npools++;
+    p->apools++;
 
     return pool;
 }
@@ -101,11 +113,11 @@ static pool_t *new_pool(pool_alloc_t *p) {
 static void pool_destroy(pool_alloc_t *p) {
     size_t i;
 
-    for (i = 0; i < p->npools; i++) {
-        free(p->pools[i].pool);
+    for (i = 0; i < p->apools; i++) {
+        htscodecs_free(p->pools[i].pool);
     }
-    free(p->pools);
-    free(p);
+    htscodecs_free(p->pools);
+    htscodecs_free(p);
 }
 
 static void *pool_alloc(pool_alloc_t *p) {
@@ -137,6 +149,14 @@ static void *pool_alloc(pool_alloc_t *p) {
     return pool->pool;
 }
 
+/*
+ * Discards all items, but keeps the pools for subsequent allocations.
+ */
+static void pool_reset(pool_alloc_t *p) {
+    p->npools = 0;
+    p->free = NULL;
+}
+
 // static void pool_free(pool_alloc_t *p, void *ptr) {
 //     *(void **)ptr = p->free;
 //     p->free = ptr;
@@ -74,7 +74,7 @@
 static
 unsigned char *rans_compress_O0(unsigned char *in, unsigned int in_size,
                                 unsigned int *out_size) {
-    unsigned char *out_buf = malloc(1.05*in_size + 257*257*3 + 9);
+    unsigned char *out_buf = htscodecs_malloc(1.05*in_size + 257*257*3 + 9);
     unsigned char *cp, *out_end;
     RansEncSymbol syms[256];
     RansState rans0;
@@ -92,8 +92,8 @@ unsigned char *rans_compress_O0(unsigned char *in, unsigned int in_size,
     ptr = out_end = out_buf + (uint32_t)(1.05*in_size) + 257*257*3 + 9;
 
     // Compute statistics
-    if (hist8(in, in_size, (uint32_t *)F) < 0) {
-        free(out_buf);
+    if (htscodecs_hist8(in, in_size, (uint32_t *)F) < 0) {
+        htscodecs_free(out_buf);
         return NULL;
     }
     tr = in_size ? ((uint64_t)TOTFREQ<<31)/in_size + (1<<30)/in_size : 0;
@@ -217,6 +217,9 @@ typedef struct {
     unsigned char R[TOTFREQ];
 } ari_decoder;
 
+// Maximum number of order-1 contexts for the packed decode table
+#define O1_PACKED_CTX 64
+
 static
 unsigned char *rans_uncompress_O0(unsigned char *in, unsigned int in_size,
                                   unsigned int *out_size) {
@@ -257,7 +260,7 @@ unsigned char *rans_uncompress_O0(unsigned char *in, unsigned int in_size,
         return NULL;
 #endif
 
-    out_buf = malloc(out_sz);
+    out_buf = htscodecs_malloc(out_sz);
     if (!out_buf)
         return NULL;
 
@@ -379,7 +382,7 @@ unsigned char *rans_uncompress_O0(unsigned char *in, unsigned int in_size,
     return (unsigned char *)out_buf;
 
  cleanup:
-    free(out_buf);
+    htscodecs_free(out_buf);
     return NULL;
 }
 
@@ -407,14 +410,14 @@ unsigned char *rans_compress_O1(unsigned char *in, unsigned int in_size,
     int T[256+MAGIC] = {0};
     int i, j;
 
-    out_buf = malloc(1.05*in_size + 257*257*3 + 9);
+    out_buf = htscodecs_malloc(1.05*in_size + 257*257*3 + 9);
     if (!out_buf) goto cleanup;
 
     out_end = out_buf + (uint32_t)(1.05*in_size) + 257*257*3 + 9;
     cp = out_buf+9;
 
-    if (hist1_4(in, in_size, (uint32_t (*)[256])F, (uint32_t *)T) < 0) {
-        free(out_buf);
+    if (htscodecs_hist1_4(in, in_size, (uint32_t (*)[256])F, (uint32_t *)T) < 0) {
+        htscodecs_free(out_buf);
         out_buf = NULL;
         goto cleanup;
     }
@@ -595,6 +598,62 @@ unsigned char *rans_compress_O1(unsigned char *in, unsigned int in_size,
     return out_buf;
 }
 
+/*
+ * The main order-1 decode loop using the packed S table built in
+ * rans_uncompress_O1.  This is a separate function working on a local
+ * copy of the states, as gcc otherwise keeps them in memory and the loop
+ * runs at nearly half the speed.
+ *
+ * Returns the last context of the 4th state for decoding the remainder.
+ */
+static
+uint32_t rans_uncompress_O1_packed(uint32_t (*S)[TOTFREQ], int16_t *map,
+                                   RansState *R_p, uint8_t **ptr_p,
+                                   uint8_t *ptr_end, uint8_t *out,
+                                   unsigned int isz4) {
+    const uint32_t mask = (1u << TF_SHIFT)-1;
+    uint8_t *ptr = *ptr_p;
+    RansState R[4] = {R_p[0], R_p[1], R_p[2], R_p[3]};
+    uint32_t l0 = map[0], l1 = map[0], l2 = map[0], l3 = map[0];
+    unsigned int i;
+
+    for (i = 0; likely(i < isz4); i++) {
+        uint32_t S0 = S[l0][R[0] & mask];
+        out[i] = S0;
+        R[0] = ((S0>>(TF_SHIFT+8))+1) * (R[0]>>TF_SHIFT) + ((S0>>8) & mask);
+        l0 = map[(uint8_t)S0];
+
+        uint32_t S1 = S[l1][R[1] & mask];
+        out[i+isz4] = S1;
+        R[1] = ((S1>>(TF_SHIFT+8))+1) * (R[1]>>TF_SHIFT) + ((S1>>8) & mask);
+        l1 = map[(uint8_t)S1];
+
+        uint32_t S2 = S[l2][R[2] & mask];
+        out[i+2*isz4] = S2;
+        R[2] = ((S2>>(TF_SHIFT+8))+1) * (R[2]>>TF_SHIFT) + ((S2>>8) & mask);
+        l2 = map[(uint8_t)S2];
+
+        uint32_t S3 = S[l3][R[3] & mask];
+        out[i+3*isz4] = S3;
+        R[3] = ((S3>>(TF_SHIFT+8))+1) * (R[3]>>TF_SHIFT) + ((S3>>8) & mask);
+        l3 = map[(uint8_t)S3];
+
+        if ((ptr < ptr_end)) {
+            RansDecRenorm2(&R[0], &R[1], &ptr);
+            RansDecRenorm2(&R[2], &R[3], &ptr);
+        } else {
+            RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
+        }
+    }
+
+    memcpy(R_p, R, sizeof(R));
+    *ptr_p = ptr;
+    return l3;
+}
+
 static
 unsigned char *rans_uncompress_O1(unsigned char *in, unsigned int in_size,
                                   unsigned int *out_size) {
@@ -683,7 +742,7 @@ unsigned char *rans_uncompress_O1(unsigned char *in, unsigned int in_size,
             RansDecSymbolInit32(&syms[m_i][j], C, F);
 
             /* Build reverse lookup table */
-            //if (!D[i].R) D[i].R = (unsigned char *)malloc(TOTFREQ);
+            //if (!D[i].R) D[i].R = (unsigned char *)htscodecs_malloc(TOTFREQ);
             if (x + F > TOTFREQ)
                 goto cleanup;
 
@@ -747,15 +806,41 @@ unsigned char *rans_uncompress_O1(unsigned char *in, unsigned int in_size,
     unsigned int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
 
     /* Allocate output buffer */
-    out_buf = malloc(out_sz);
+    out_buf = htscodecs_malloc(out_sz);
     if (!out_buf) goto cleanup;
 
+    ptr_end -= 8;
+
+    // With few contexts, one packed lookup per symbol holding the symbol,
+    // frequency-1 and offset into the frequency range is faster than the
+    // dependent lookups into D and then syms.  It needs 16KB per context
+    // however, so we only build it when it fits in cache and the output
+    // is large enough to amortise the cost.
+    uint32_t (*S)[TOTFREQ] = NULL;
+    if (map_i <= O1_PACKED_CTX && out_sz >= map_i * TOTFREQ)
+        S = htscodecs_tls_alloc(map_i * sizeof(*S));
+    if (S) {
+        const uint32_t mask = (1u << TF_SHIFT)-1;
+        for (i = 0; i < map_i; i++) {
+            for (x = 0; x < TOTFREQ; x++) {
+                uint8_t c = D[i].R[x];
+                S[i][x] = (((syms[i][c].freq-1) & mask) << (TF_SHIFT+8))
+                    | (((x - syms[i][c].start) & mask) << 8) | c;
+            }
+        }
+
+        l3 = rans_uncompress_O1_packed(S, map, R, &ptr, ptr_end,
+                                       (uint8_t *)out_buf, isz4);
+        i4[0] += isz4; i4[1] += isz4; i4[2] += isz4; i4[3] += isz4;
+        htscodecs_tls_free(S);
+        goto remainder;
+    }
+
     uint8_t cc0 = D[map[l0]].R[R[0] & ((1u << TF_SHIFT)-1)];
     uint8_t cc1 = D[map[l1]].R[R[1] & ((1u << TF_SHIFT)-1)];
     uint8_t cc2 = D[map[l2]].R[R[2] & ((1u << TF_SHIFT)-1)];
     uint8_t cc3 = D[map[l3]].R[R[3] & ((1u << TF_SHIFT)-1)];
 
-    ptr_end -= 8;
     for (; likely(i4[0] < isz4); i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
         // seq4-head2: file q40b
         //          O3      O2
@@ -805,6 +890,7 @@ unsigned char *rans_uncompress_O1(unsigned char *in, unsigned int in_size,
     }
 
     // Remainder
+ remainder:
     for (; i4[3] < out_sz; i4[3]++) {
         unsigned char c3 = D[l3].R[RansDecGet(&R[3], TF_SHIFT)];
         out_buf[i4[3]] = c3;
@@ -81,6 +81,14 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
 int rans_compute_shift(uint32_t *F0, uint32_t (*F)[256], uint32_t *T,
                        uint32_t *S);
 
+// Checkpointed container, see rANS_static4x16pr_stream.c.  As with
+// RANS_ORDER_PARALLEL this combination is never a valid order byte.
+#define RANS_CKPT_MAGIC (RANS_ORDER_STRIPE | RANS_ORDER_NOSZ | RANS_ORDER_CAT)
+
+unsigned char *rans4x16_ckpt_header(unsigned char *in, unsigned int in_size,
+                                    unsigned int interval,
+                                    unsigned int *hdr_size);
+
 // Rounds to next power of 2.
 // credit to http://graphics.stanford.edu/~seander/bithacks.html
 static inline uint32_t round2(uint32_t v) {
@@ -305,6 +313,12 @@ static inline int encode_freq_d(uint8_t *cp, uint32_t *F0, uint32_t *F) {
     return cp - op;
 }
 
+// The order-1 histogram function used by encode_freq1.  This may be
+// defined prior to including this file to select a SIMD implementation.
+#ifndef HIST1_4
+#define HIST1_4 hist1_4
+#endif
+
 // Normalise frequency total T[i] to match TOTFREQ_O1 and encode.
 // Also initialises the RansEncSymbol structs.
 //
@@ -320,7 +334,7 @@ static inline int encode_freq1(uint8_t *in, uint32_t in_size, int Nway,
         return -1;
     uint32_t T[256+MAGIC] = {0};
     int isz4 = in_size/Nway;
-    if (hist1_4(in, in_size, F, T) < 0)
+    if (HIST1_4(in, in_size, F, T) < 0)
         goto err;
     for (z = 1; z < Nway; z++)
         F[0][in[z*isz4]]++;
@@ -397,18 +411,20 @@ static inline int encode_freq1(uint8_t *in, uint32_t in_size, int Nway,
     if (cp - out > 1000) {
         uint8_t *op = out;
         // try rans0 compression of header
+        // (Use the TLS pool to avoid a malloc per call.)
         unsigned int u_freq_sz = cp-(op+1);
-        unsigned int c_freq_sz;
-        unsigned char *c_freq = rans_compress_O0_4x16(op+1, u_freq_sz, NULL,
-                                                      &c_freq_sz);
-        if (c_freq && c_freq_sz + 6 < cp-op) {
+        unsigned int c_freq_sz = rans_compress_bound_4x16(u_freq_sz, 0);
+        unsigned char *c_freq = htscodecs_tls_alloc(c_freq_sz);
+        if (c_freq &&
+            rans_compress_O0_4x16(op+1, u_freq_sz, c_freq, &c_freq_sz) &&
+            c_freq_sz + 6 < cp-op) {
             *op++ |= 1; // compressed
             op += var_put_u32(op, NULL, u_freq_sz);
             op += var_put_u32(op, NULL, c_freq_sz);
             memcpy(op, c_freq, c_freq_sz);
             cp = op+c_freq_sz;
         }
-        free(c_freq);
+        htscodecs_tls_free(c_freq);
     }
 
     *cp_p = cp;
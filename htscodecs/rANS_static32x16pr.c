@@ -79,7 +79,7 @@ unsigned char *rans_compress_O0_32x16(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = out_free = malloc(*out_size);
+        out = out_free = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -104,7 +104,7 @@ unsigned char *rans_compress_O0_32x16(unsigned char *in,
         max_val = TOTFREQ;
 
     if (normalise_freq(F, fsum, max_val) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
     fsum=max_val;
@@ -115,7 +115,7 @@ unsigned char *rans_compress_O0_32x16(unsigned char *in,
     //write(2, out+4, cp-(out+4));
 
     if (normalise_freq(F, fsum, TOTFREQ) < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -273,7 +273,7 @@ unsigned char *rans_uncompress_O0_32x16(unsigned char *in,
     uint32_t s3[TOTFREQ]; // For TF_SHIFT <= 12
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -403,7 +403,7 @@ unsigned char *rans_uncompress_O0_32x16(unsigned char *in,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -423,7 +423,7 @@ unsigned char *rans_compress_O1_32x16(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -434,14 +434,14 @@ unsigned char *rans_compress_O1_32x16(unsigned char *in,
 
     RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
     if (!syms) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
     cp = out;
     int shift = encode_freq1(in, in_size, 32, syms, &cp); 
     if (shift < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         htscodecs_tls_free(syms);
         return NULL;
     }
@@ -572,7 +572,7 @@ unsigned char *rans_uncompress_O1_32x16(unsigned char *in,
     uint32_t (*s3)[TOTFREQ_O1_FAST] = (uint32_t (*)[TOTFREQ_O1_FAST])sfb_;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -601,7 +601,7 @@ unsigned char *rans_uncompress_O1_32x16(unsigned char *in,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp_end - cp < NX * 4)
@@ -747,8 +747,8 @@ unsigned char *rans_uncompress_O1_32x16(unsigned char *in,
 
  err:
     htscodecs_tls_free(sfb_);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
@@ -34,6 +34,8 @@
 #ifndef RANS_STATIC32x16PR_H
 #define RANS_STATIC32x16PR_H
 
+#include <stdint.h>
+
 /*
  * This header contains standard scalar implementations of the 32-way
  * unrolled rANS codec as well as declarations for the custom SIMD
@@ -118,6 +120,12 @@ unsigned char *rans_uncompress_O1_32x16_avx2(unsigned char *in,
                                              unsigned int in_size,
                                              unsigned char *out,
                                              unsigned int out_sz);
+
+// Histogram construction; identical output to hist8 and hist1_4
+int hist8_avx2(unsigned char *in, unsigned int in_size, uint32_t F0[256]);
+
+int hist1_4_avx2(unsigned char *in, unsigned int in_size,
+                 uint32_t F0[256][256], uint32_t *T0);
 #endif // HAVE_AVX2
 
 //----------------------------------------------------------------------
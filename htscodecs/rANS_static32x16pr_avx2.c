@@ -44,7 +44,9 @@
 
 #include "rANS_word.h"
 #include "rANS_static4x16.h"
+#include "rANS_static32x16pr.h"
 #define ROT32_SIMD
+#define HIST1_4 hist1_4_avx2
 #include "rANS_static16_int.h"
 #include "varint.h"
 #include "utils.h"
@@ -169,7 +171,7 @@ unsigned char *rans_compress_O0_32x16_avx2(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -184,7 +186,7 @@ unsigned char *rans_compress_O0_32x16_avx2(unsigned char *in,
         goto empty;
 
     // Compute statistics
-    if (hist8(in, in_size, F) < 0)
+    if (hist8_avx2(in, in_size, F) < 0)
         return NULL;
 
     // Normalise so frequences sum to power of 2
@@ -475,7 +477,7 @@ unsigned char *rans_uncompress_O0_32x16_avx2(unsigned char *in,
     uint32_t s3[TOTFREQ] __attribute__((aligned(32))); // For TF_SHIFT <= 12
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -689,7 +691,7 @@ unsigned char *rans_uncompress_O0_32x16_avx2(unsigned char *in,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -708,7 +710,7 @@ unsigned char *rans_compress_O1_32x16_avx2(unsigned char *in, unsigned int in_si
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -719,14 +721,14 @@ unsigned char *rans_compress_O1_32x16_avx2(unsigned char *in, unsigned int in_si
 
     RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
     if (!syms) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
     cp = out;
     int shift = encode_freq1(in, in_size, 32, syms, &cp); 
     if (shift < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         htscodecs_tls_free(syms);
         return NULL;
     }
@@ -1053,7 +1055,7 @@ unsigned char *rans_uncompress_O1_32x16_avx2(unsigned char *in,
     uint32_t (*s3F)[TOTFREQ_O1_FAST] = (uint32_t (*)[TOTFREQ_O1_FAST])s3;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -1083,7 +1085,7 @@ unsigned char *rans_uncompress_O1_32x16_avx2(unsigned char *in,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp_end - cp < NX * 4)
@@ -1612,11 +1614,172 @@ unsigned char *rans_uncompress_O1_32x16_avx2(unsigned char *in,
 
  err:
     htscodecs_tls_free(s3);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
+
+/*
+ * Histogram construction.
+ *
+ * The scalar hist8 and hist1_4 in utils.h are limited by store-to-load
+ * forwarding when the same counter is incremented repeatedly, which is
+ * common for quality values.  We spread the increments over more
+ * sub-tables, pulling 8 symbols at a time out of a 64-bit word, and use
+ * AVX2 for merging the tables back together.
+ *
+ * We also tried an AVX512CD approach (vpconflictd to resolve duplicate
+ * indices followed by gather / scatter), but it was around 1/3rd the
+ * speed of these, being limited by scatter throughput.
+ */
+int hist8_avx2(unsigned char *in, unsigned int in_size, uint32_t F0[256]) {
+    // Clearing and merging the extra sub-tables doesn't pay off on
+    // small inputs.
+    if (in_size < 4096)
+        return hist8(in, in_size, F0);
+
+    uint32_t F[8][256] __attribute__((aligned(32)));
+    memset(F, 0, sizeof(F));
+
+    uint32_t i, i16 = in_size & ~15;
+    for (i = 0; i < i16; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, in+i,   8);
+        memcpy(&b, in+i+8, 8);
+
+        F[0][(uint8_t)(a    )]++;
+        F[1][(uint8_t)(a>> 8)]++;
+        F[2][(uint8_t)(a>>16)]++;
+        F[3][(uint8_t)(a>>24)]++;
+        F[4][(uint8_t)(a>>32)]++;
+        F[5][(uint8_t)(a>>40)]++;
+        F[6][(uint8_t)(a>>48)]++;
+        F[7][          a>>56 ]++;
+
+        F[0][(uint8_t)(b    )]++;
+        F[1][(uint8_t)(b>> 8)]++;
+        F[2][(uint8_t)(b>>16)]++;
+        F[3][(uint8_t)(b>>24)]++;
+        F[4][(uint8_t)(b>>32)]++;
+        F[5][(uint8_t)(b>>40)]++;
+        F[6][(uint8_t)(b>>48)]++;
+        F[7][          b>>56 ]++;
+    }
+
+    while (i < in_size)
+        F0[in[i++]]++;
+
+    for (i = 0; i < 256; i += 8) {
+        __m256i s0 = _mm256_add_epi32(_mm256_load_si256((__m256i *)&F[0][i]),
+                                      _mm256_load_si256((__m256i *)&F[1][i]));
+        __m256i s1 = _mm256_add_epi32(_mm256_load_si256((__m256i *)&F[2][i]),
+                                      _mm256_load_si256((__m256i *)&F[3][i]));
+        __m256i s2 = _mm256_add_epi32(_mm256_load_si256((__m256i *)&F[4][i]),
+                                      _mm256_load_si256((__m256i *)&F[5][i]));
+        __m256i s3 = _mm256_add_epi32(_mm256_load_si256((__m256i *)&F[6][i]),
+                                      _mm256_load_si256((__m256i *)&F[7][i]));
+        s0 = _mm256_add_epi32(_mm256_add_epi32(s0, s1),
+                              _mm256_add_epi32(s2, s3));
+        s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((__m256i *)&F0[i]));
+        _mm256_storeu_si256((__m256i *)&F0[i], s0);
+    }
+
+    return 0;
+}
+
+// Horizontal sum of 8 32-bit lanes
+static inline uint32_t hsum_epi32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+/*
+ * Order-1 equivalent of hist8_avx2, with identical output to hist1_4.
+ *
+ * Small inputs use a single table, as clearing and merging a second
+ * 256x256 table costs more than it saves.  Given F0 starts zeroed, as it
+ * does for all callers, the row totals are then an order-0 histogram of
+ * the initial 0 context plus all but the last symbol.  Hist1_4 adds the
+ * last symbol to T0 too, so T0 is simply hist8 of the input plus one for
+ * symbol 0.  This is far cheaper than summing 64k counters.
+ *
+ * For larger inputs we alternate between two tables and sum the rows
+ * while merging.
+ */
+int hist1_4_avx2(unsigned char *in, unsigned int in_size,
+                 uint32_t F0[256][256], uint32_t *T0) {
+    uint32_t i = 0, l = 0;
+
+    if (in_size < 65536) {
+        for (; i+8 < in_size; i += 8) {
+            uint64_t a;
+            memcpy(&a, in+i, 8);
+            F0[l             ][(uint8_t)(a    )]++;
+            F0[(uint8_t)(a    )][(uint8_t)(a>> 8)]++;
+            F0[(uint8_t)(a>> 8)][(uint8_t)(a>>16)]++;
+            F0[(uint8_t)(a>>16)][(uint8_t)(a>>24)]++;
+            F0[(uint8_t)(a>>24)][(uint8_t)(a>>32)]++;
+            F0[(uint8_t)(a>>32)][(uint8_t)(a>>40)]++;
+            F0[(uint8_t)(a>>40)][(uint8_t)(a>>48)]++;
+            F0[(uint8_t)(a>>48)][          a>>56 ]++;
+            l = a>>56;
+        }
+        for (; i < in_size; i++) {
+            F0[l][in[i]]++;
+            l = in[i];
+        }
+
+        if (hist8_avx2(in, in_size, T0) < 0)
+            return -1;
+        T0[0]++;
+
+        return 0;
+    }
+
+    uint32_t (*F1)[256] = htscodecs_tls_calloc(256, sizeof(*F1));
+    if (!F1)
+        return -1;
+
+    for (; i+8 < in_size; i += 8) {
+        uint64_t a;
+        memcpy(&a, in+i, 8);
+        F0[l             ][(uint8_t)(a    )]++;
+        F1[(uint8_t)(a    )][(uint8_t)(a>> 8)]++;
+        F0[(uint8_t)(a>> 8)][(uint8_t)(a>>16)]++;
+        F1[(uint8_t)(a>>16)][(uint8_t)(a>>24)]++;
+        F0[(uint8_t)(a>>24)][(uint8_t)(a>>32)]++;
+        F1[(uint8_t)(a>>32)][(uint8_t)(a>>40)]++;
+        F0[(uint8_t)(a>>40)][(uint8_t)(a>>48)]++;
+        F1[(uint8_t)(a>>48)][          a>>56 ]++;
+        l = a>>56;
+    }
+    for (; i < in_size; i++) {
+        F0[l][in[i]]++;
+        l = in[i];
+    }
+    T0[l]++;
+
+    int j, k;
+    for (j = 0; j < 256; j++) {
+        __m256i t = _mm256_setzero_si256();
+        for (k = 0; k < 256; k += 8) {
+            __m256i f = _mm256_add_epi32
+                (_mm256_loadu_si256((__m256i *)&F0[j][k]),
+                 _mm256_loadu_si256((__m256i *)&F1[j][k]));
+            _mm256_storeu_si256((__m256i *)&F0[j][k], f);
+            t = _mm256_add_epi32(t, f);
+        }
+        T0[j] += hsum_epi32(t);
+    }
+    htscodecs_tls_free(F1);
+
+    return 0;
+}
+
 #else  // HAVE_AVX2
 // Prevent "empty translation unit" errors when building without AVX2
 const char *rANS_static32x16pr_avx2_disabled = "No AVX2";
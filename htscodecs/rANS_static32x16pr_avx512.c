@@ -50,7 +50,15 @@
 
 #include "rANS_word.h"
 #include "rANS_static4x16.h"
+#include "rANS_static32x16pr.h"
 #define ROT32_SIMD
+#ifdef HAVE_AVX2
+// All AVX512 capable CPUs also have AVX2
+#define HIST1_4 hist1_4_avx2
+#define HIST8   hist8_avx2
+#else
+#define HIST8   hist8
+#endif
 #include "rANS_static16_int.h"
 #include "varint.h"
 #include "utils.h"
@@ -138,7 +146,7 @@ unsigned char *rans_compress_O0_32x16_avx512(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -153,7 +161,7 @@ unsigned char *rans_compress_O0_32x16_avx512(unsigned char *in,
         goto empty;
 
     // Compute statistics
-    if (hist8(in, in_size, F) < 0)
+    if (HIST8(in, in_size, F) < 0)
         return NULL;
 
     // Normalise so frequences sum to power of 2
@@ -329,7 +337,7 @@ unsigned char *rans_uncompress_O0_32x16_avx512(unsigned char *in,
     uint32_t s3[TOTFREQ]  __attribute__((aligned(64))); // For TF_SHIFT <= 12
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -457,7 +465,7 @@ unsigned char *rans_uncompress_O0_32x16_avx512(unsigned char *in,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -509,6 +517,53 @@ static inline void transpose_and_copy_avx512(uint8_t *out, int iN[32],
 }
 #endif // TBUF
 
+#ifndef USE_GATHER
+// Fetches 16 whole RansEncSymbol records, at byte offsets idx from base,
+// and transposes them into vectors of x_max, rcp_freq, bias and the
+// combined cmpl_freq / rcp_shift.
+//
+// This is 16 128-bit loads instead of 64 32-bit ones as used by four
+// separate (simulated) gathers.  Records 4k to 4k+3 land in 128-bit lane
+// k of A, B, C and D, so a standard 4x4 transpose within each 128-bit
+// lane yields the fields in natural lane order.
+static inline void load_syms16(__m512i idx, uint8_t *base,
+                               __m512i *xmax, __m512i *rcp,
+                               __m512i *bias, __m512i *sd) {
+    int c[16] __attribute__((aligned(32)));
+    _mm256_store_si256((__m256i *)(c),   _mm512_castsi512_si256(idx));
+    _mm256_store_si256((__m256i *)(c+8), _mm512_extracti64x4_epi64(idx, 1));
+
+#define LD(i) _mm_loadu_si128((__m128i *)(base + c[i]))
+    __m512i A = _mm512_castsi128_si512(LD(0));
+    __m512i B = _mm512_castsi128_si512(LD(1));
+    __m512i C = _mm512_castsi128_si512(LD(2));
+    __m512i D = _mm512_castsi128_si512(LD(3));
+    A = _mm512_inserti32x4(A, LD(4),  1);
+    B = _mm512_inserti32x4(B, LD(5),  1);
+    C = _mm512_inserti32x4(C, LD(6),  1);
+    D = _mm512_inserti32x4(D, LD(7),  1);
+    A = _mm512_inserti32x4(A, LD(8),  2);
+    B = _mm512_inserti32x4(B, LD(9),  2);
+    C = _mm512_inserti32x4(C, LD(10), 2);
+    D = _mm512_inserti32x4(D, LD(11), 2);
+    A = _mm512_inserti32x4(A, LD(12), 3);
+    B = _mm512_inserti32x4(B, LD(13), 3);
+    C = _mm512_inserti32x4(C, LD(14), 3);
+    D = _mm512_inserti32x4(D, LD(15), 3);
+#undef LD
+
+    __m512i t0 = _mm512_unpacklo_epi32(A, B); // Ax Bx Ar Br
+    __m512i t1 = _mm512_unpacklo_epi32(C, D); // Cx Dx Cr Dr
+    __m512i t2 = _mm512_unpackhi_epi32(A, B); // Ab Bb Ac Bc
+    __m512i t3 = _mm512_unpackhi_epi32(C, D); // Cb Db Cc Dc
+
+    *xmax = _mm512_unpacklo_epi64(t0, t1);
+    *rcp  = _mm512_unpackhi_epi64(t0, t1);
+    *bias = _mm512_unpacklo_epi64(t2, t3);
+    *sd   = _mm512_unpackhi_epi64(t2, t3);
+}
+#endif
+
 unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
                                              unsigned int in_size,
                                              unsigned char *out,
@@ -524,7 +579,7 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -535,14 +590,14 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
 
     RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
     if (!syms) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
     cp = out;
     int shift = encode_freq1(in, in_size, 32, syms, &cp);
     if (shift < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         htscodecs_tls_free(syms);
         return NULL;
     }
@@ -612,8 +667,14 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
         __m512i vidx2 = _mm512_slli_epi32(c2, 8);
         vidx1 = _mm512_add_epi32(vidx1, last1);
         vidx2 = _mm512_add_epi32(vidx2, last2);
+#ifdef USE_GATHER
         vidx1 = _mm512_slli_epi32(vidx1, 2);
         vidx2 = _mm512_slli_epi32(vidx2, 2);
+#else
+        // Byte offsets of whole RansEncSymbol records
+        vidx1 = _mm512_slli_epi32(vidx1, 4);
+        vidx2 = _mm512_slli_epi32(vidx2, 4);
+#endif
 
         // ------------------------------------------------------------
         //      for (z = NX-1; z >= 0; z--) {
@@ -685,14 +746,24 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
         }
         // End of "equivalent to" code block
 
+#ifdef USE_GATHER
         SET512x(xmax, x_max); // high latency
+#else
+        // Whole symbol records at once, rather than field by field
+        __m512i xmax1, rfv1, biasv1, SDv1;
+        __m512i xmax2, rfv2, biasv2, SDv2;
+        load_syms16(vidx1, (uint8_t *)syms, &xmax1, &rfv1, &biasv1, &SDv1);
+        load_syms16(vidx2, (uint8_t *)syms, &xmax2, &rfv2, &biasv2, &SDv2);
+#endif
 
         uint16_t gt_mask1 = _mm512_cmpgt_epi32_mask(Rv1, xmax1);
         int pc1 = _mm_popcnt_u32(gt_mask1);
         __m512i Rp1 = _mm512_and_si512(Rv1, _mm512_set1_epi32(0xffff));
         __m512i Rp2 = _mm512_and_si512(Rv2, _mm512_set1_epi32(0xffff));
         uint16_t gt_mask2 = _mm512_cmpgt_epi32_mask(Rv2, xmax2);
+#ifdef USE_GATHER
         SET512x(SDv, cmpl_freq); // good
+#endif
         int pc2 = _mm_popcnt_u32(gt_mask2);
 
         Rp1 = _mm512_maskz_compress_epi32(gt_mask1, Rp1);
@@ -710,7 +781,9 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
         // uint32_t q = (uint32_t) (((uint64_t)ransN[z] * rcp_freq[z])
         //                          >> rcp_shift[z]);
         // ransN[z] = ransN[z] + bias[z] + q * cmpl_freq[z];
+#ifdef USE_GATHER
         SET512x(rfv, rcp_freq); // good-ish
+#endif
 
         __m512i rf1_hm = _mm512_mul_epu32(_mm512_srli_epi64(Rv1, 32),
                                           _mm512_srli_epi64(rfv1, 32));
@@ -725,7 +798,9 @@ unsigned char *rans_compress_O1_32x16_avx512(unsigned char *in,
         rfv1 = _mm512_or_epi32(rf1_lm, rf1_hm);
         rfv2 = _mm512_or_epi32(rf2_lm, rf2_hm);
 
+#ifdef USE_GATHER
         SET512x(biasv, bias); // good
+#endif
         __m512i shiftv1 = _mm512_srli_epi32(SDv1, 16);
         __m512i shiftv2 = _mm512_srli_epi32(SDv2, 16);
 
@@ -791,7 +866,7 @@ unsigned char *rans_uncompress_O1_32x16_avx512(unsigned char *in,
     uint32_t (*s3F)[TOTFREQ_O1_FAST] = (uint32_t (*)[TOTFREQ_O1_FAST])s3;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -821,7 +896,7 @@ unsigned char *rans_uncompress_O1_32x16_avx512(unsigned char *in,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp_end - cp < NX * 4)
@@ -1177,8 +1252,8 @@ unsigned char *rans_uncompress_O1_32x16_avx512(unsigned char *in,
 
  err:
     htscodecs_tls_free(s3);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
@@ -89,7 +89,7 @@ unsigned char *rans_compress_O0_32x16_neon(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -610,7 +610,7 @@ unsigned char *rans_uncompress_O0_32x16_neon(unsigned char *in,
     uint32_t s3[TOTFREQ]; // For TF_SHIFT <= 12
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -906,7 +906,7 @@ unsigned char *rans_uncompress_O0_32x16_neon(unsigned char *in,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -927,7 +927,7 @@ unsigned char *rans_compress_O1_32x16_neon(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -938,14 +938,14 @@ unsigned char *rans_compress_O1_32x16_neon(unsigned char *in,
 
     RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
     if (!syms) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
     cp = out;
     int shift = encode_freq1(in, in_size, 32, syms, &cp); 
     if (shift < 0) {
-        free(out_free);
+        htscodecs_free(out_free);
         htscodecs_tls_free(syms);
         return NULL;
     }
@@ -1443,7 +1443,7 @@ unsigned char *rans_uncompress_O1_32x16_neon(unsigned char *in,
     }
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -1523,7 +1523,7 @@ unsigned char *rans_uncompress_O1_32x16_neon(unsigned char *in,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp_end - cp < NX * 4)
@@ -1962,8 +1962,8 @@ unsigned char *rans_uncompress_O1_32x16_neon(unsigned char *in,
 
  err:
     htscodecs_tls_free(sfb_);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
@@ -221,7 +221,7 @@ unsigned char *rans_compress_O0_32x16_sse4(unsigned char *in,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -481,7 +481,7 @@ unsigned char *rans_uncompress_O0_32x16_sse4(unsigned char *in,
     uint32_t s3[TOTFREQ] __attribute__((aligned(32))); // For TF_SHIFT <= 12
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -788,7 +788,7 @@ unsigned char *rans_uncompress_O0_32x16_sse4(unsigned char *in,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -1052,7 +1052,7 @@ unsigned char *rans_uncompress_O1_32x16_sse4(unsigned char *in,
     uint32_t (*s3F)[TOTFREQ_O1_FAST] = (uint32_t (*)[TOTFREQ_O1_FAST])s3;
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -1081,7 +1081,7 @@ unsigned char *rans_uncompress_O1_32x16_sse4(unsigned char *in,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp_end - cp < NX * 4)
@@ -1817,8 +1817,8 @@ unsigned char *rans_uncompress_O1_32x16_sse4(unsigned char *in,
 
  err:
     htscodecs_tls_free(s3);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
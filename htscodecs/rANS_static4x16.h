@@ -49,6 +49,167 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
 unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
                                     unsigned int *out_size);
 
+/*
+ * Reusable compression contexts.
+ *
+ * These hold scratch buffers used by the STRIPE, RLE and PACK transforms,
+ * so repeated calls (eg many small CRAM blocks) do not need to malloc and
+ * free them each time.  The buffers grow as required and are released
+ * by rans4x16_ctx_destroy.
+ *
+ * A context must not be used by more than one thread at a time.
+ * rans_compress_ctx and rans_uncompress_ctx otherwise behave identically
+ * to rans_compress_to_4x16 and rans_uncompress_to_4x16.  A NULL ctx is
+ * permitted and is equivalent to calling those functions directly.
+ */
+typedef struct rans4x16_ctx rans4x16_ctx;
+
+rans4x16_ctx *rans4x16_ctx_create(void);
+void rans4x16_ctx_destroy(rans4x16_ctx *ctx);
+
+unsigned char *rans_compress_ctx(rans4x16_ctx *ctx,
+                                 unsigned char *in, unsigned int in_size,
+                                 unsigned char *out, unsigned int *out_size,
+                                 int order);
+unsigned char *rans_uncompress_ctx(rans4x16_ctx *ctx,
+                                   unsigned char *in, unsigned int in_size,
+                                   unsigned char *out, unsigned int *out_size);
+
+/*
+ * Thread control for RANS_ORDER_PARALLEL encoding and decoding.
+ *
+ * By default sub-blocks are processed one after another.  Setting
+ * nthreads > 1 uses an internal pool of that many threads for each call
+ * (the calling thread being one of them).
+ *
+ * Alternatively the caller can supply its own thread pool by means of a
+ * "parallel for" function.  This must call job(job_arg, i) for every i
+ * from 0 to njobs-1, in any order and on any threads, and only return once
+ * all have completed.  It should return 0 on success and -1 on failure.
+ * This takes priority over nthreads.
+ */
+typedef void rans_par_job(void *job_arg, int i);
+typedef int rans_par_for(void *pool_arg, rans_par_job *job, void *job_arg,
+                         int njobs);
+
+void rans4x16_ctx_set_threads(rans4x16_ctx *ctx, int nthreads);
+void rans4x16_ctx_set_pool(rans4x16_ctx *ctx, rans_par_for *func,
+                           void *pool_arg);
+
+/*
+ * Batch compression of many independent blocks in a single call.
+ *
+ * Each entry is compressed as if by rans_compress_ctx(ctx, in, in_size,
+ * out, &out_size, order).  On input out may be NULL, in which case it is
+ * malloced, or a buffer of out_size bytes which should be at least
+ * rans_compress_bound_4x16(in_size, order).  On output out_size holds the
+ * compressed size, or 0 if that entry failed.
+ *
+ * Serially the context's scratch buffers are reused for every entry.  If
+ * ctx has threads or a pool set (see above) then the entries are split
+ * into groups of similar total size which are compressed concurrently,
+ * each with its own temporary context.  Small batches are always run
+ * serially.
+ *
+ * Returns 0 on success, or -1 if any entry failed.
+ */
+typedef struct {
+    unsigned char *in;
+    unsigned int in_size;
+    unsigned char *out;
+    unsigned int out_size;
+    int order;
+} rans4x16_batch;
+
+int rans_compress_batch_4x16(rans4x16_ctx *ctx, rans4x16_batch *b, int n);
+
+/*
+ * Static frequency models.
+ *
+ * A model is built once from representative data and then used to encode
+ * and decode many subsequent blocks, avoiding the cost of computing and
+ * storing frequency tables per block.  Each block records only the ID of
+ * its model, so the decoder may be given several models to choose from.
+ * The model must be stored separately by the caller, using
+ * rans4x16_model_store and rans4x16_model_load.
+ *
+ * Only order-0 and order-1 are supported.  Blocks using symbols not
+ * seen when building the model, or which the model codes poorly, are
+ * automatically stored as normal rANS 4x16 streams instead.
+ *
+ * Models are read-only once created, so may be shared between threads.
+ *
+ * NB: this is not part of the CRAM 3.1 rANS-Nx16 format.
+ */
+typedef struct rans4x16_model rans4x16_model;
+
+rans4x16_model *rans4x16_model_build(unsigned char *in, unsigned int in_size,
+                                     int order, unsigned int id);
+void rans4x16_model_destroy(rans4x16_model *m);
+unsigned int rans4x16_model_id(rans4x16_model *m);
+
+// Serialises a model to a malloced buffer, and back again.
+unsigned char *rans4x16_model_store(rans4x16_model *m, unsigned int *out_size);
+rans4x16_model *rans4x16_model_load(unsigned char *in, unsigned int in_size);
+
+// As rans_compress_to_4x16, but the size of "out", if supplied, should be
+// at least rans_compress_bound_4x16(in_size, order)+1.
+unsigned char *rans_compress_model_4x16(rans4x16_model *m,
+                                        unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int *out_size);
+
+// Decodes a block, finding the model it used amongst "models".
+unsigned char *rans_uncompress_model_4x16(rans4x16_model **models,
+                                          int nmodels,
+                                          unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned char *out,
+                                          unsigned int *out_size);
+
+/*
+ * Streaming decoder.
+ *
+ * Decodes a block incrementally, returning the uncompressed data in
+ * caller sized chunks instead of as a single buffer.  At most buf_size
+ * bytes of uncompressed data are held internally (0 for the default of
+ * 8MB), so very large blocks may be decoded with bounded memory.
+ *
+ * Only plain order-0 and order-1 (4 or 32 way) and CAT blocks are
+ * supported; rans4x16_stream_init returns NULL for other formats.
+ * Order-1 data is decoded in multiple passes when its size exceeds
+ * buf_size, costing up to one extra decode per buf_size bytes.
+ *
+ * The compressed data must remain valid until rans4x16_stream_finish.
+ * rans4x16_stream_next returns the number of bytes written to out, 0 at
+ * the end of the data or -1 on error.  rans4x16_stream_finish frees the
+ * stream and returns -1 if an error occurred, 0 otherwise.
+ */
+typedef struct rans4x16_stream rans4x16_stream;
+
+rans4x16_stream *rans4x16_stream_init(unsigned char *in, unsigned int in_size,
+                                      unsigned int buf_size);
+unsigned int rans4x16_stream_size(rans4x16_stream *s);
+int rans4x16_stream_next(rans4x16_stream *s, unsigned char *out,
+                         unsigned int n);
+int rans4x16_stream_finish(rans4x16_stream *s);
+
+/*
+ * Decodes len bytes starting at offset start of the uncompressed data,
+ * into out or a malloced buffer if out is NULL.  This is fast for blocks
+ * compressed with RANS_ORDER_CHECKPOINT, and decodes the entire block
+ * otherwise.
+ *
+ * Returns the decoded data on success, or NULL on failure or if the
+ * range exceeds the uncompressed size.
+ */
+unsigned char *rans_uncompress_range_4x16(unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned int start,
+                                          unsigned int len,
+                                          unsigned char *out);
+
 // CPU detection control.  Used for testing and benchmarking.
 // These bitfields control what methods are permitted to be used.
 #define RANS_CPU_ENC_SSE4     (1<<0)
@@ -102,6 +263,40 @@ void rans_set_cpu(int opts);
 // Used to request automatic selection between 4-way and 32-way
 #define RANS_ORDER_SIMD_AUTO  (1<<17)
 
+// Block-parallel mode.  Inputs larger than the sub-block size are split
+// into independently encoded sub-blocks, with an index of their sizes, so
+// both encoding and decoding can be spread over multiple threads.  See
+// rans4x16_ctx_set_threads.  The remaining order bits apply to each
+// sub-block.
+//
+// Bits 20-24 optionally hold log2 of the sub-block size, from 12 to 30.
+// Zero means the default of 1MB.
+//
+// NB: this is an extension to the CRAM 3.1 rANS-Nx16 format and should
+// only be used when the reader is known to be using this library.
+#define RANS_ORDER_PARALLEL   (1<<18)
+#define RANS_ORDER_PAR_SHIFT  20
+
+// Automatic selection of order-0/1, PACK, RLE, STRIPE and CAT based on
+// cheap entropy estimates of the input, in place of brute force trials.
+// The low order bits are replaced; X32, SIMD_AUTO, NOSZ and PARALLEL
+// are kept.  Bits 8-15 may hold the STRIPE width to consider (default 4).
+#define RANS_ORDER_AUTO       (1<<19)
+
+// Random access checkpoints.  Plain order-0 and order-1 streams get an
+// index of decoder states, so rans_uncompress_range_4x16 can decode part
+// of the block starting from the nearest checkpoint.  The block remains
+// decodable by rans_uncompress_to_4x16.  Ignored for other transforms.
+// Compression fails if combined with RANS_ORDER_PARALLEL.
+//
+// Bits 26-30 optionally hold log2 of the checkpoint interval in bytes,
+// from 10 to 30.  Zero means the default of 64KB.
+//
+// NB: this is an extension to the CRAM 3.1 rANS-Nx16 format and should
+// only be used when the reader is known to be using this library.
+#define RANS_ORDER_CHECKPOINT (1<<25)
+#define RANS_ORDER_CKPT_SHIFT 26
+
 #ifdef __cplusplus
 }
 #endif
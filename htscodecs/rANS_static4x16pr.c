@@ -63,6 +63,7 @@
 
 #include "rANS_word.h"
 #include "rANS_static4x16.h"
+#define HIST1_4 htscodecs_hist1_4
 #include "rANS_static16_int.h"
 #include "pack.h"
 #include "rle.h"
@@ -90,7 +91,54 @@
  * are easier to understand, but can be up to 2x slower.
  */
 
+// Sub-block size for RANS_ORDER_PARALLEL; see rANS_static4x16.h
+static inline unsigned int rans_par_block_size(int order) {
+    int shift = (order >> RANS_ORDER_PAR_SHIFT) & 31;
+    if (shift == 0)
+        shift = 20;
+    else if (shift < 12)
+        shift = 12;
+    else if (shift > 30)
+        shift = 30;
+    return 1u << shift;
+}
+
+// Checkpoint interval for RANS_ORDER_CHECKPOINT; see rANS_static4x16.h
+static inline unsigned int rans_ckpt_interval(int order) {
+    int shift = (order >> RANS_ORDER_CKPT_SHIFT) & 31;
+    if (shift == 0)
+        shift = 16;
+    else if (shift < 10)
+        shift = 10;
+    else if (shift > 30)
+        shift = 30;
+    return 1u << shift;
+}
+
 unsigned int rans_compress_bound_4x16(unsigned int size, int order) {
+    if (order & RANS_ORDER_PARALLEL) {
+        // Each sub-block has its own tables and meta-data, plus the index
+        order &= ~RANS_ORDER_PARALLEL;
+        uint64_t bs = rans_par_block_size(order);
+        uint64_t nb = (size + bs-1) / bs;
+        uint64_t sz = rans_compress_bound_4x16(size, order) + 11
+            + nb * (rans_compress_bound_4x16(0, order) + 5);
+        return sz > UINT_MAX ? 0 : sz;
+    }
+
+    if (order & RANS_ORDER_CHECKPOINT) {
+        // Header plus one checkpoint (offset, states, contexts) per interval
+        order &= ~RANS_ORDER_CHECKPOINT;
+        uint64_t nc = size / rans_ckpt_interval(order) + 1;
+        uint64_t sz = rans_compress_bound_4x16(size, order) + 16
+            + nc * (4 + 32*5);
+        return sz > UINT_MAX ? 0 : sz;
+    }
+
+    if (order & RANS_ORDER_AUTO)
+        // Worst case of anything the selection may pick
+        order |= 1 | RANS_ORDER_PACK | RANS_ORDER_RLE | RANS_ORDER_STRIPE;
+
     int N = (order>>8) & 0xff;
     if (!N) N=4;
 
@@ -125,7 +173,7 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out = malloc(*out_size);
+        out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -140,7 +188,7 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
         goto empty;
 
     // Compute statistics
-    if (hist8(in, in_size, F) < 0)
+    if (htscodecs_hist8(in, in_size, F) < 0)
         return NULL;
 
     // Normalise so frequences sum to power of 2
@@ -233,7 +281,7 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     uint8_t  ssym [TOTFREQ+64]; // faster to use 16-bit on clang
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
     if (!out)
         return NULL;
 
@@ -323,7 +371,7 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     return out;
 
  err:
-    free(out_free);
+    htscodecs_free(out_free);
     return NULL;
 }
 
@@ -409,7 +457,7 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 
     if (!out) {
         *out_size = bound;
-        out_free = out = malloc(*out_size);
+        out_free = out = htscodecs_malloc(*out_size);
     }
     if (!out || bound > *out_size)
         return NULL;
@@ -420,7 +468,7 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 
     RansEncSymbol (*syms)[256] = htscodecs_tls_alloc(256 * (sizeof(*syms)));
     if (!syms) {
-        free(out_free);
+        htscodecs_free(out_free);
         return NULL;
     }
 
@@ -541,7 +589,7 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
     }
 
     if (!out)
-        out_free = out = malloc(out_sz);
+        out_free = out = htscodecs_malloc(out_sz);
 
     if (!out)
         goto err;
@@ -618,7 +666,7 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
 
     if (tab_end)
         cp = tab_end;
-    free(c_freq);
+    htscodecs_free(c_freq);
     c_freq = NULL;
 
     if (cp+16 > cp_end)
@@ -793,8 +841,8 @@ unsigned char *rans_uncompress_O1_4x16(unsigned char *in, unsigned int in_size,
  err:
     htscodecs_tls_free(fb);
     htscodecs_tls_free(sfb_);
-    free(out_free);
-    free(c_freq);
+    htscodecs_free(out_free);
+    htscodecs_free(c_freq);
 
     return NULL;
 }
@@ -965,19 +1013,11 @@ unsigned char *(*rans_enc_func(int do_simd, int order))
     if (!(rans_cpu & RANS_CPU_ENC_SSE4))   have_e_sse4_1  = 0;
 
     if (order & 1) {
-        // With simulated gathers, the AVX512 is now slower than AVX2, so
-        // we avoid using it unless asking for the real avx512 gather.
-        // Note for testing we do -c 0x0404 to enable AVX512 and disable AVX2.
-        // We then need to call the avx512 func regardless.
-        int use_gather;
-#ifdef USE_GATHER
-        use_gather = 1;
-#else
-        use_gather = !have_e_avx2;
-#endif
-
+        // The AVX512 encoder loads whole symbol records rather than
+        // simulating a gather per field, which makes it faster than AVX2
+        // on Intel.  Zen4 is still quicker with AVX2.
 #if defined(HAVE_AVX512)
-        if (have_e_avx512f && (!is_amd || !have_e_avx2) && use_gather)
+        if (have_e_avx512f && (!is_amd || !have_e_avx2))
             return rans_compress_O1_32x16_avx512;
 #endif
 #if defined(HAVE_AVX2)
@@ -1069,6 +1109,39 @@ unsigned char *(*rans_dec_func(int do_simd, int order))
     }
 }
 
+// Whether to use the SIMD histogram functions.  These are AVX2, but the
+// AVX512 encoders use them too so we permit either.
+static inline int rans_hist_simd(void) {
+#ifdef NO_THREADS
+    htscodecs_tls_cpu_init();
+#else
+    int err = pthread_once(&rans_cpu_once, htscodecs_tls_cpu_init);
+    if (err != 0)
+        return 0;
+#endif
+
+    return have_avx2
+        && (rans_cpu & (RANS_CPU_ENC_AVX2 | RANS_CPU_ENC_AVX512));
+}
+
+int htscodecs_hist8(unsigned char *in, unsigned int in_size,
+                    uint32_t F0[256]) {
+#if defined(HAVE_AVX2)
+    if (rans_hist_simd())
+        return hist8_avx2(in, in_size, F0);
+#endif
+    return hist8(in, in_size, F0);
+}
+
+int htscodecs_hist1_4(unsigned char *in, unsigned int in_size,
+                      uint32_t F0[256][256], uint32_t *T0) {
+#if defined(HAVE_AVX2)
+    if (rans_hist_simd())
+        return hist1_4_avx2(in, in_size, F0, T0);
+#endif
+    return hist1_4(in, in_size, F0, T0);
+}
+
 #elif defined(__ARM_NEON) && defined(__aarch64__)
 
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -1185,6 +1258,19 @@ unsigned char *(*rans_dec_func(int do_simd, int order))
 
 #endif
 
+#ifndef HAVE_HTSCODECS_TLS_CPU_INIT
+// No SIMD histogram implementations on this platform
+int htscodecs_hist8(unsigned char *in, unsigned int in_size,
+                    uint32_t F0[256]) {
+    return hist8(in, in_size, F0);
+}
+
+int htscodecs_hist1_4(unsigned char *in, unsigned int in_size,
+                      uint32_t F0[256][256], uint32_t *T0) {
+    return hist1_4(in, in_size, F0, T0);
+}
+#endif
+
 // Test interface for restricting the auto-detection methods so we
 // can forcibly compare different implementations on the same machine.
 // See RANS_CPU_ defines in rANS_static4x16.h
@@ -1195,14 +1281,359 @@ void rans_set_cpu(int opts) {
 #endif
 }
 
+/*-----------------------------------------------------------------------------
+ * Reusable compression contexts.
+ *
+ * The transforms (STRIPE, RLE, PACK) need temporary buffers which are
+ * normally malloced and freed on every call.  A rans4x16_ctx keeps a
+ * small pool of these around so repeated calls on a similar sized data
+ * can avoid the allocation overhead entirely.  This is a similar idea to
+ * the htscodecs_tls_alloc pool in utils.c, but explicitly owned by the
+ * caller so the memory lifetime is obvious and not tied to threads.
+ *
+ * A NULL context simply maps to malloc and free.
+ */
+#define RANS_CTX_NBUF 8
+struct rans4x16_ctx {
+    void   *bufs[RANS_CTX_NBUF];
+    size_t sizes[RANS_CTX_NBUF];
+    int     used[RANS_CTX_NBUF];
+
+    // RANS_ORDER_PARALLEL execution; see rans4x16_ctx_set_threads
+    int nthreads;
+    rans_par_for *par_func;
+    void *par_arg;
+};
+
+rans4x16_ctx *rans4x16_ctx_create(void) {
+    return htscodecs_calloc(1, sizeof(rans4x16_ctx));
+}
+
+void rans4x16_ctx_destroy(rans4x16_ctx *ctx) {
+    if (!ctx)
+        return;
+
+    int i;
+    for (i = 0; i < RANS_CTX_NBUF; i++)
+        htscodecs_free(ctx->bufs[i]);
+    htscodecs_free(ctx);
+}
+
+// Returns an unused buffer of at least size bytes.  We pick the smallest
+// buffer that fits, or failing that grow the largest unused one, so the
+// pool settles down to a stable set of sizes after a few calls.
+// If all buffers are in use (eg deeply nested malformed STRIPE data)
+// we fall back to malloc.
+static void *rctx_alloc(rans4x16_ctx *ctx, size_t size) {
+    if (!ctx)
+        return htscodecs_malloc(size);
+
+    int i, best = -1, grow = -1;
+    for (i = 0; i < RANS_CTX_NBUF; i++) {
+        if (ctx->used[i])
+            continue;
+        if (size <= ctx->sizes[i]) {
+            if (best == -1 || ctx->sizes[i] < ctx->sizes[best])
+                best = i;
+        } else if (grow == -1 || ctx->sizes[i] > ctx->sizes[grow]) {
+            grow = i;
+        }
+    }
+
+    if (best == -1) {
+        if (grow == -1)
+            return htscodecs_malloc(size);
+
+        // No need to preserve contents, so avoid realloc's memcpy
+        htscodecs_free(ctx->bufs[grow]);
+        ctx->sizes[grow] = 0;
+        if (!(ctx->bufs[grow] = htscodecs_malloc(size)))
+            return NULL;
+        ctx->sizes[grow] = size;
+        best = grow;
+    }
+
+    ctx->used[best] = 1;
+    return ctx->bufs[best];
+}
+
+static void rctx_free(rans4x16_ctx *ctx, void *ptr) {
+    if (!ptr)
+        return;
+
+    if (ctx) {
+        int i;
+        for (i = 0; i < RANS_CTX_NBUF; i++) {
+            if (ctx->bufs[i] == ptr && ctx->used[i]) {
+                ctx->used[i] = 0;
+                return;
+            }
+        }
+    }
+
+    htscodecs_free(ptr);
+}
+
+void rans4x16_ctx_set_threads(rans4x16_ctx *ctx, int nthreads) {
+    ctx->nthreads = nthreads;
+}
+
+void rans4x16_ctx_set_pool(rans4x16_ctx *ctx, rans_par_for *func,
+                           void *pool_arg) {
+    ctx->par_func = func;
+    ctx->par_arg  = pool_arg;
+}
+
+/*-----------------------------------------------------------------------------
+ * Block-parallel mode (RANS_ORDER_PARALLEL).
+ *
+ * The input is split into fixed size sub-blocks which are each encoded as
+ * an entirely independent rANS 4x16 stream.  The sub-blocks are preceded
+ * by an index of their compressed sizes so the decoder can locate them
+ * all up front and decode them concurrently too.
+ *
+ * Format:
+ *     u8     RANS_ORDER_STRIPE | RANS_ORDER_NOSZ (never emitted otherwise)
+ *     u32v   uncompressed size
+ *     u32v   sub-block size
+ *     u32v   compressed size, for each of ceil(usize/bsize) sub-blocks
+ *     ...    sub-block data, each a NOSZ rANS 4x16 stream.
+ *
+ * The sub-blocks are executed via a caller supplied "parallel for"
+ * function, or a simple internal pthread pool if not.  Each job uses
+ * its own temporary memory, so we don't use the ctx buffers in the jobs.
+ */
+#define RANS_PAR_MAGIC (RANS_ORDER_STRIPE | RANS_ORDER_NOSZ)
+
+typedef struct {
+    unsigned char *in;
+    unsigned int in_size;
+    unsigned char *out;
+    unsigned int out_size;
+} rans_par_blk;
+
+typedef struct {
+    rans_par_blk *blk;
+    int order;  // encoder only
+    int err;    // set by any failing job; benign race as only ever set to 1
+} rans_par_job_arg;
+
+static unsigned char *rans_compress_to_4x16_ctx(rans4x16_ctx *ctx,
+                                                unsigned char *in,
+                                                unsigned int in_size,
+                                                unsigned char *out,
+                                                unsigned int *out_size,
+                                                int order);
+static unsigned char *rans_uncompress_to_4x16_ctx(rans4x16_ctx *ctx,
+                                                  unsigned char *in,
+                                                  unsigned int in_size,
+                                                  unsigned char *out,
+                                                  unsigned int *out_size);
+
+static void rans_par_enc_job(void *arg, int i) {
+    rans_par_job_arg *a = (rans_par_job_arg *)arg;
+    rans_par_blk *b = &a->blk[i];
+
+    b->out_size = rans_compress_bound_4x16(b->in_size, a->order);
+    if (!(b->out = htscodecs_malloc(b->out_size)) ||
+        !rans_compress_to_4x16_ctx(NULL, b->in, b->in_size,
+                                   b->out, &b->out_size, a->order))
+        a->err = 1;
+}
+
+static void rans_par_dec_job(void *arg, int i) {
+    rans_par_job_arg *a = (rans_par_job_arg *)arg;
+    rans_par_blk *b = &a->blk[i];
+    unsigned int osz = b->out_size;
+
+    if (!rans_uncompress_to_4x16_ctx(NULL, b->in, b->in_size,
+                                     b->out, &osz)
+        || osz != b->out_size)
+        a->err = 1;
+}
+
+// Runs job(job_arg, i) for all i in [0, njobs).
+static int rans_par_run(rans4x16_ctx *ctx, rans_par_job *job, void *job_arg,
+                        int njobs) {
+    if (ctx && ctx->par_func)
+        return ctx->par_func(ctx->par_arg, job, job_arg, njobs);
+
+    return htscodecs_par_run(ctx ? ctx->nthreads : 1, job, job_arg, njobs);
+}
+
+// Returns out on success with *out_size holding the compressed size,
+//         NULL on failure.
+static unsigned char *rans_compress_par_4x16(rans4x16_ctx *ctx,
+                                             unsigned char *in,
+                                             unsigned int in_size,
+                                             unsigned char *out,
+                                             unsigned int *out_size,
+                                             int order) {
+    unsigned int bs = rans_par_block_size(order);
+    int i, nb = (in_size + (uint64_t)bs-1) / bs;
+    unsigned char *out_end = out + *out_size, *cp = out;
+    rans_par_job_arg a = {NULL, 0, 0};
+
+    if (!(a.blk = htscodecs_calloc(nb, sizeof(*a.blk))))
+        return NULL;
+
+    // The sub-block sizes are implicit, so we can omit them.
+    a.order = (order & ~RANS_ORDER_PARALLEL) | RANS_ORDER_NOSZ;
+    for (i = 0; i < nb; i++) {
+        a.blk[i].in = in + (uint64_t)i*bs;
+        a.blk[i].in_size = i < nb-1 ? bs : in_size - (uint64_t)i*bs;
+    }
+
+    if (rans_par_run(ctx, rans_par_enc_job, &a, nb) < 0 || a.err)
+        goto err;
+
+    if (5*(nb+3) > *out_size)
+        goto err;
+    *cp++ = RANS_PAR_MAGIC;
+    cp += var_put_u32(cp, out_end, in_size);
+    cp += var_put_u32(cp, out_end, bs);
+    for (i = 0; i < nb; i++)
+        cp += var_put_u32(cp, out_end, a.blk[i].out_size);
+
+    for (i = 0; i < nb; i++) {
+        if (a.blk[i].out_size > out_end - cp)
+            goto err;
+        memcpy(cp, a.blk[i].out, a.blk[i].out_size);
+        cp += a.blk[i].out_size;
+    }
+
+    for (i = 0; i < nb; i++)
+        htscodecs_free(a.blk[i].out);
+    htscodecs_free(a.blk);
+
+    *out_size = cp - out;
+    return out;
+
+ err:
+    for (i = 0; i < nb; i++)
+        htscodecs_free(a.blk[i].out);
+    htscodecs_free(a.blk);
+    return NULL;
+}
+
+static unsigned char *rans_uncompress_par_4x16(rans4x16_ctx *ctx,
+                                               unsigned char *in,
+                                               unsigned int in_size,
+                                               unsigned char *out,
+                                               unsigned int *out_size) {
+    unsigned char *in_end = in + in_size, *cp = in+1, *out_free = NULL;
+    unsigned int ulen, bs, clen;
+    rans_par_job_arg a = {NULL, 0, 0};
+    int i, nb;
+
+    cp += var_get_u32(cp, in_end, &ulen);
+    cp += var_get_u32(cp, in_end, &bs);
+    // The encoder only writes powers of two; see rans_par_block_size
+    if (bs < (1u<<12) || bs > (1u<<30) || (bs & (bs-1)) || ulen >= INT_MAX)
+        return NULL;
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (ulen > 100000)
+        return NULL;
+#endif
+    nb = (ulen + (uint64_t)bs-1) / bs;
+
+    // Each sub-block needs at least one byte of input
+    if (nb > in_end - cp)
+        return NULL;
+
+    if (!out) {
+        if (!(out_free = out = htscodecs_malloc(ulen ? ulen : 1)))
+            return NULL;
+        *out_size = ulen;
+    }
+    if (*out_size < ulen)
+        goto err;
+
+    if (nb && !(a.blk = htscodecs_calloc(nb, sizeof(*a.blk))))
+        goto err;
+
+    // Index of compressed sizes, turned into sub-block locations
+    for (i = 0; i < nb; i++) {
+        if (cp >= in_end)
+            goto err;
+        cp += var_get_u32(cp, in_end, &clen);
+        a.blk[i].in_size = clen;
+        a.blk[i].out = out + (uint64_t)i*bs;
+        a.blk[i].out_size = i < nb-1 ? bs : ulen - (uint64_t)i*bs;
+    }
+    for (i = 0; i < nb; i++) {
+        if (a.blk[i].in_size > in_end - cp || a.blk[i].in_size == 0)
+            goto err;
+        a.blk[i].in = cp;
+        cp += a.blk[i].in_size;
+    }
+
+    if (rans_par_run(ctx, rans_par_dec_job, &a, nb) < 0 || a.err)
+        goto err;
+
+    htscodecs_free(a.blk);
+    *out_size = ulen;
+    return out;
+
+ err:
+    htscodecs_free(a.blk);
+    htscodecs_free(out_free);
+    return NULL;
+}
+
+/*
+ * RANS_ORDER_CHECKPOINT.  The block is compressed as normal and then
+ * given a header of checkpoints if it is plain order-0 or order-1.  See
+ * rANS_static4x16pr_stream.c for the format.
+ */
+static unsigned char *rans_compress_ckpt_4x16(rans4x16_ctx *ctx,
+                                              unsigned char *in,
+                                              unsigned int in_size,
+                                              unsigned char *out,
+                                              unsigned int *out_size,
+                                              int order) {
+    unsigned int interval = rans_ckpt_interval(order), hdr_size = 0;
+    unsigned char *hdr;
+
+    order &= ~RANS_ORDER_CHECKPOINT;
+    unsigned int c_size = rans_compress_bound_4x16(in_size, order);
+    unsigned char *c = rctx_alloc(ctx, c_size);
+    if (!c)
+        return NULL;
+    if (!rans_compress_to_4x16_ctx(ctx, in, in_size, c, &c_size, order)) {
+        rctx_free(ctx, c);
+        return NULL;
+    }
+
+    hdr = rans4x16_ckpt_header(c, c_size, interval, &hdr_size);
+    if ((uint64_t)hdr_size + c_size > *out_size) {
+        htscodecs_free(hdr);
+        rctx_free(ctx, c);
+        return NULL;
+    }
+
+    if (hdr)
+        memcpy(out, hdr, hdr_size);
+    memcpy(out + hdr_size, c, c_size);
+    *out_size = hdr_size + c_size;
+
+    htscodecs_free(hdr);
+    rctx_free(ctx, c);
+    return out;
+}
+
 /*-----------------------------------------------------------------------------
  * Simple interface to the order-0 vs order-1 encoders and decoders.
  *
  * Smallest is method, <in_size> <input>, so worst case 2 bytes longer.
  */
-unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
-                                     unsigned char *out,unsigned int *out_size,
-                                     int order) {
+static
+unsigned char *rans_compress_to_4x16_ctx(rans4x16_ctx *ctx,
+                                         unsigned char *in,
+                                         unsigned int in_size,
+                                         unsigned char *out,
+                                         unsigned int *out_size,
+                                         int order) {
     if (in_size > INT_MAX || (out && *out_size == 0)) {
         *out_size = 0;
         return NULL;
@@ -1222,7 +1653,7 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         *out_size = rans_compress_bound_4x16(in_size, order);
         if (*out_size == 0)
             return NULL;
-        if (!(out_free = out = malloc(*out_size))) {
+        if (!(out_free = out = htscodecs_malloc(*out_size))) {
             *out_size = 0;
             return NULL;
         }
@@ -1230,6 +1661,52 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
 
     unsigned char *out_end = out + *out_size;
 
+    if (order & RANS_ORDER_PARALLEL) {
+        // A checkpoint index covers one stream, not a set of sub-blocks
+        if (order & RANS_ORDER_CHECKPOINT) {
+            htscodecs_free(out_free);
+            *out_size = 0;
+            return NULL;
+        }
+        if (in_size > rans_par_block_size(order)) {
+            if (!rans_compress_par_4x16(ctx, in, in_size, out, out_size,
+                                        order)) {
+                htscodecs_free(out_free);
+                *out_size = 0;
+                return NULL;
+            }
+            return out;
+        }
+        order &= ~RANS_ORDER_PARALLEL;
+    }
+
+    if (order & RANS_ORDER_CHECKPOINT) {
+        if (!(order & RANS_ORDER_NOSZ)) {
+            if (!rans_compress_ckpt_4x16(ctx, in, in_size, out, out_size,
+                                         order)) {
+                htscodecs_free(out_free);
+                *out_size = 0;
+                return NULL;
+            }
+            return out;
+        }
+        order &= ~RANS_ORDER_CHECKPOINT;
+    }
+
+    // Replace the order with an estimated best one.  If this is STRIPE
+    // then each sub-stream is also auto-selected instead of brute forced.
+    int auto_lanes = 0;
+    if (order & RANS_ORDER_AUTO) {
+        int auto_order = htscodecs_auto_order(in, in_size,
+                                              (order>>8) & 0xff, 0);
+        order = (order & (RANS_ORDER_X32 | RANS_ORDER_SIMD_AUTO
+                          | RANS_ORDER_NOSZ))
+            | auto_order;
+        if (auto_order & (RANS_ORDER_STRIPE | RANS_ORDER_CAT))
+            order &= ~(RANS_ORDER_X32 | RANS_ORDER_SIMD_AUTO);
+        auto_lanes = auto_order & RANS_ORDER_STRIPE;
+    }
+
     // Permit 32-way unrolling for large blocks, paving the way for
     // AVX2 and AVX512 SIMD variants.
     if ((order & RANS_ORDER_SIMD_AUTO) && in_size >= 50000
@@ -1249,11 +1726,11 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         if (N > in_size)
             N = in_size;
 
-        unsigned char *transposed = malloc(in_size);
+        unsigned char *transposed = rctx_alloc(ctx, in_size);
         unsigned int part_len[256];
         unsigned int idx[256];
         if (!transposed) {
-            free(out_free);
+            htscodecs_free(out_free);
             *out_size = 0;
             return NULL;
         }
@@ -1293,8 +1770,8 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         *out = order & ~RANS_ORDER_NOSZ;
         c_meta_len += var_put_u32(out+c_meta_len, out_end, in_size);
         if (c_meta_len >= *out_size) {
-            free(out_free);
-            free(transposed);
+            htscodecs_free(out_free);
+            rctx_free(ctx, transposed);
             *out_size = 0;
             return NULL;
         }
@@ -1310,8 +1787,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             uint8_t *r;
             int j, m[] = {1,64,128,0}, best_j = 0, best_sz = INT_MAX;
             for (j = 0; j < sizeof(m)/sizeof(*m); j++) {
-                if ((order & m[j]) != m[j])
+                int mj = m[j];
+                if (auto_lanes) {
+                    // A single estimated method, without nested striping
+                    if (j)
+                        break;
+                    mj = RANS_ORDER_AUTO | (1<<8);
+                } else if ((order & m[j]) != m[j]) {
                     continue;
+                }
 
                 // order-1 *only*; bit check above cannot elide order-0
                 if ((order & RANS_ORDER_STRIPE_NO0) && (m[j]&1) == 0)
@@ -1321,18 +1805,21 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
                     continue; // an error, but caught in best_sz check later
 
                 olen2 = *out_size - (out2 - out);
-                r = rans_compress_to_4x16(transposed+idx[i], part_len[i],
-                                          out2, &olen2,
-                                          m[j] | RANS_ORDER_NOSZ
-                                          | (order&RANS_ORDER_X32));
+                r = rans_compress_to_4x16_ctx(ctx,
+                                              transposed+idx[i], part_len[i],
+                                              out2, &olen2,
+                                              mj | RANS_ORDER_NOSZ
+                                              | (order&RANS_ORDER_X32));
                 if (r && olen2 && best_sz > olen2) {
                     best_sz = olen2;
                     best_j = j;
                     if (j < sizeof(m)/sizeof(*m) && olen2 > out_best_len) {
-                        unsigned char *tmp = realloc(out_best, olen2);
+                        // Contents are replaced below, so no realloc
+                        rctx_free(ctx, out_best);
+                        unsigned char *tmp = rctx_alloc(ctx, olen2);
                         if (!tmp) {
-                            free(out_free);
-                            free(transposed);
+                            htscodecs_free(out_free);
+                            rctx_free(ctx, transposed);
                             *out_size = 0;
                             return NULL;
                         }
@@ -1346,9 +1833,9 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             }
 
             if (best_sz == INT_MAX) {
-                free(out_best);
-                free(out_free);
-                free(transposed);
+                rctx_free(ctx, out_best);
+                htscodecs_free(out_free);
+                rctx_free(ctx, transposed);
                 *out_size = 0;
                 return NULL;
             }
@@ -1362,11 +1849,10 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             out2 += olen2;
             c_meta_len += var_put_u32(out+c_meta_len, out_end, olen2);
         }
-        if (out_best)
-            free(out_best);
+        rctx_free(ctx, out_best);
 
         memmove(out+c_meta_len, out2_start, out2-out2_start);
-        free(transposed);
+        rctx_free(ctx, transposed);
         *out_size = c_meta_len + out2-out2_start;
         return out;
     }
@@ -1377,7 +1863,7 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         c_meta_len += var_put_u32(&out[1], out_end, in_size);
 
         if (c_meta_len + in_size > *out_size) {
-            free(out_free);
+            htscodecs_free(out_free);
             *out_size = 0;
             return NULL;
         }
@@ -1410,15 +1896,20 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         int pmeta_len;
         uint64_t packed_len;
         if (c_meta_len + 256 > *out_size) {
-            free(out_free);
+            htscodecs_free(out_free);
+            *out_size = 0;
+            return NULL;
+        }
+        if (!(packed = rctx_alloc(ctx, in_size+1))) {
+            htscodecs_free(out_free);
             *out_size = 0;
             return NULL;
         }
-        packed = hts_pack(in, in_size, out+c_meta_len, &pmeta_len, &packed_len);
-        if (!packed) {
+        if (!hts_pack_to(in, in_size, out+c_meta_len, &pmeta_len,
+                         packed, &packed_len)) {
             out[0] &= ~RANS_ORDER_PACK;
             do_pack = 0;
-            free(packed);
+            rctx_free(ctx, packed);
             packed = NULL;
         } else {
             in = packed;
@@ -1445,8 +1936,9 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         unsigned int rmeta_len, c_rmeta_len;
         uint64_t rle_len;
         c_rmeta_len = in_size+257;
-        if (!(meta = malloc(c_rmeta_len))) {
-            free(out_free);
+        if (!(meta = rctx_alloc(ctx, c_rmeta_len))) {
+            rctx_free(ctx, packed);
+            htscodecs_free(out_free);
             *out_size = 0;
             return NULL;
         }
@@ -1454,8 +1946,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         uint8_t rle_syms[256];
         int rle_nsyms = 0;
         uint64_t rmeta_len64;
-        rle = hts_rle_encode(in, in_size, meta, &rmeta_len64,
-                             rle_syms, &rle_nsyms, NULL, &rle_len);
+        if (!(rle = rctx_alloc(ctx, in_size))) {
+            rctx_free(ctx, meta);
+            rctx_free(ctx, packed);
+            htscodecs_free(out_free);
+            *out_size = 0;
+            return NULL;
+        }
+        hts_rle_encode(in, in_size, meta, &rmeta_len64,
+                       rle_syms, &rle_nsyms, rle, &rle_len);
         memmove(meta+1+rle_nsyms, meta, rmeta_len64);
         meta[0] = rle_nsyms;
         memcpy(meta+1, rle_syms, rle_nsyms);
@@ -1465,17 +1964,17 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             // Not worth the speed hit.
             out[0] &= ~RANS_ORDER_RLE;
             do_rle = 0;
-            free(rle);
+            rctx_free(ctx, rle);
             rle = NULL;
         } else {
             // Compress lengths with O0 and literals with O0/O1 ("order" param)
             int sz = var_put_u32(out+c_meta_len, out_end, rmeta_len*2), sz2;
             sz += var_put_u32(out+c_meta_len+sz, out_end, rle_len);
             if ((c_meta_len+sz+5) > *out_size) {
-                free(out_free);
-                free(rle);
-                free(meta);
-                free(packed);
+                htscodecs_free(out_free);
+                rctx_free(ctx, rle);
+                rctx_free(ctx, meta);
+                rctx_free(ctx, packed);
                 *out_size = 0;
                 return NULL;
             }
@@ -1485,10 +1984,10 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
                 out[0] &= ~RANS_ORDER_X32;
             }
             if (!rans_enc_func(do_simd, 0)(meta, rmeta_len, out+c_meta_len+sz+5, &c_rmeta_len)) {
-                free(out_free);
-                free(rle);
-                free(meta);
-                free(packed);
+                htscodecs_free(out_free);
+                rctx_free(ctx, rle);
+                rctx_free(ctx, meta);
+                rctx_free(ctx, packed);
                 *out_size = 0;
                 return NULL;
             }
@@ -1509,15 +2008,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             in_size = rle_len;
         }
 
-        free(meta);
+        rctx_free(ctx, meta);
     } else if (do_rle) {
         out[0] &= ~RANS_ORDER_RLE;
     }
 
     if (c_meta_len > *out_size) {
-        free(out_free);
-        free(rle);
-        free(packed);
+        htscodecs_free(out_free);
+        rctx_free(ctx, rle);
+        rctx_free(ctx, packed);
         *out_size = 0;
         return NULL;
     }
@@ -1529,9 +2028,9 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
     }
 
     if (!rans_enc_func(do_simd, order)(in, in_size, out+c_meta_len, out_size)) {
-        free(out_free);
-        free(rle);
-        free(packed);
+        htscodecs_free(out_free);
+        rctx_free(ctx, rle);
+        rctx_free(ctx, packed);
         *out_size = 0;
         return NULL;
     }
@@ -1541,9 +2040,9 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         out[0] |= RANS_ORDER_CAT | no_size;
 
         if (out + c_meta_len + in_size > out_end) {
-            free(out_free);
-            free(rle);
-            free(packed);
+            htscodecs_free(out_free);
+            rctx_free(ctx, rle);
+            rctx_free(ctx, packed);
             *out_size = 0;
             return NULL;
         }
@@ -1552,15 +2051,15 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
         *out_size = in_size;
     }
 
-    free(rle);
-    free(packed);
+    rctx_free(ctx, rle);
+    rctx_free(ctx, packed);
 
     *out_size += c_meta_len;
 
 // Validation mode
 #ifdef VALIDATE_RANS
     unsigned int decoded_size = orig_in_size;
-    unsigned char *decoded = malloc(decoded_size);
+    unsigned char *decoded = htscodecs_malloc(decoded_size);
     decoded = rans_uncompress_to_4x16(out, *out_size,
                                       decoded, &decoded_size);
     if (!decoded ||
@@ -1571,26 +2070,157 @@ unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
             abort();
         abort();
     }
-    free(decoded);
+    htscodecs_free(decoded);
 #endif
 
 
     return out;
 }
 
+unsigned char *rans_compress_to_4x16(unsigned char *in, unsigned int in_size,
+                                     unsigned char *out,unsigned int *out_size,
+                                     int order) {
+    return rans_compress_to_4x16_ctx(NULL, in, in_size, out, out_size, order);
+}
+
+unsigned char *rans_compress_ctx(rans4x16_ctx *ctx,
+                                 unsigned char *in, unsigned int in_size,
+                                 unsigned char *out, unsigned int *out_size,
+                                 int order) {
+    return rans_compress_to_4x16_ctx(ctx, in, in_size, out, out_size, order);
+}
+
 unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
                                   unsigned int *out_size, int order) {
     return rans_compress_to_4x16(in, in_size, NULL, out_size, order);
 }
 
-unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
-                                       unsigned char *out, unsigned int *out_size) {
+/*-----------------------------------------------------------------------------
+ * Batch compression.
+ *
+ * The entries are divided into groups of consecutive entries with roughly
+ * equal total input size.  Each group is compressed by a single job using
+ * a single context, so the scratch buffers are reused from one entry to
+ * the next instead of being allocated per call.  When running serially
+ * this is the caller's context; in parallel each job has its own as
+ * contexts are not thread safe.
+ */
+
+// Don't split batches into groups smaller than this, as for tiny blocks
+// the thread start up costs outweigh any gain.
+#define RANS_BATCH_MIN_GROUP 32768
+
+// Number of groups to use with a caller supplied thread pool, where we
+// don't know how many threads it has.
+#define RANS_BATCH_POOL_GROUPS 64
+
+typedef struct {
+    rans4x16_batch *b;
+    int *grp;   // group g is entries grp[g] to grp[g+1]-1
+    int err;    // set by any failing job; benign race as only ever set to 1
+} rans_batch_arg;
+
+static int rans_batch_one(rans4x16_ctx *ctx, rans4x16_batch *b) {
+    unsigned char *out = rans_compress_to_4x16_ctx(ctx, b->in, b->in_size,
+                                                   b->out, &b->out_size,
+                                                   b->order);
+    if (!out) {
+        b->out_size = 0;
+        return -1;
+    }
+
+    b->out = out;
+    return 0;
+}
+
+static void rans_batch_job(void *arg, int g) {
+    rans_batch_arg *a = (rans_batch_arg *)arg;
+
+    // A failed context allocation only loses the buffer reuse
+    rans4x16_ctx *ctx = rans4x16_ctx_create();
+
+    int i;
+    for (i = a->grp[g]; i < a->grp[g+1]; i++)
+        if (rans_batch_one(ctx, &a->b[i]) < 0)
+            a->err = 1;
+
+    rans4x16_ctx_destroy(ctx);
+}
+
+int rans_compress_batch_4x16(rans4x16_ctx *ctx, rans4x16_batch *b, int n) {
+    int i, g, ngrp = 1, err = 0;
+    uint64_t tot = 0;
+
+    for (i = 0; i < n; i++)
+        tot += b[i].in_size;
+
+    if (ctx && (ctx->par_func || ctx->nthreads > 1)) {
+        ngrp = ctx->par_func ? RANS_BATCH_POOL_GROUPS : 4*ctx->nthreads;
+        if (ngrp > tot / RANS_BATCH_MIN_GROUP)
+            ngrp = tot / RANS_BATCH_MIN_GROUP;
+        if (ngrp > n)
+            ngrp = n;
+    }
+
+    int *grp = ngrp > 1 ? htscodecs_malloc((ngrp+1) * sizeof(*grp)) : NULL;
+    if (!grp) {
+        for (i = 0; i < n; i++)
+            if (rans_batch_one(ctx, &b[i]) < 0)
+                err = -1;
+        return err;
+    }
+
+    // Split at the points where the cumulative input size crosses each
+    // multiple of tot/ngrp.
+    uint64_t cum = 0;
+    grp[0] = 0;
+    for (i = g = 0; i < n; i++) {
+        cum += b[i].in_size;
+        if (g+1 < ngrp && cum * ngrp >= (g+1) * tot)
+            grp[++g] = i+1;
+    }
+    if (grp[g] < n)
+        grp[++g] = n;
+
+    rans_batch_arg a;
+    a.b = b;
+    a.grp = grp;
+    a.err = 0;
+    if (rans_par_run(ctx, rans_batch_job, &a, g) < 0 || a.err)
+        err = -1;
+
+    htscodecs_free(grp);
+    return err;
+}
+
+static
+unsigned char *rans_uncompress_to_4x16_ctx(rans4x16_ctx *ctx,
+                                           unsigned char *in,
+                                           unsigned int in_size,
+                                           unsigned char *out,
+                                           unsigned int *out_size) {
     unsigned char *in_end = in + in_size;
     unsigned char *out_free = NULL, *tmp_free = NULL, *meta_free = NULL;
 
     if (in_size == 0)
         return NULL;
 
+    if (*in == RANS_CKPT_MAGIC) {
+        // Checkpoints are only needed by rans_uncompress_range_4x16
+        uint32_t v = 0;
+        int i;
+        in++;
+        for (i = 0; i < 3; i++)
+            in += var_get_u32(in, in_end, &v);
+        if (v >= in_end - in)
+            return NULL;
+        in += v;
+        in_size = in_end - in;
+    }
+
+    if (*in == RANS_PAR_MAGIC)
+        return rans_uncompress_par_4x16(ctx, in, in_size, out, out_size);
+
     if (*in & RANS_ORDER_STRIPE) {
         unsigned int ulen, olen, c_meta_len = 1;
         int i;
@@ -1611,13 +2241,13 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
             if (ulen > 100000)
                 return NULL;
 #endif
-            if (!(out_free = out = malloc(ulen))) {
+            if (!(out_free = out = htscodecs_malloc(ulen))) {
                 return NULL;
             }
             *out_size = ulen;
         }
         if (ulen != *out_size) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
 
@@ -1627,7 +2257,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
             c_meta_len += var_get_u32(in+c_meta_len, in_end, &clenN[i]);
             clen_tot += clenN[i];
             if (c_meta_len > in_size || clenN[i] > in_size || clenN[i] < 1) {
-                free(out_free);
+                htscodecs_free(out_free);
                 return NULL;
             }
         }
@@ -1636,7 +2266,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         // how much we really use we limit it so the recursion becomes easier
         // to limit.
         if (c_meta_len + clen_tot > in_size) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
         in_size = c_meta_len + clen_tot;
@@ -1644,22 +2274,24 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         //fprintf(stderr, "    stripe meta %d\n", c_meta_len); //c-size
 
         // Uncompress the N streams
-        unsigned char *outN = malloc(ulen);
+        unsigned char *outN = rctx_alloc(ctx, ulen);
         if (!outN) {
-            free(out_free);
+            htscodecs_free(out_free);
             return NULL;
         }
         for (i = 0; i < N; i++) {
             olen = ulenN[i];
             if (in_size < c_meta_len) {
-                free(out_free);
-                free(outN);
+                htscodecs_free(out_free);
+                rctx_free(ctx, outN);
                 return NULL;
             }
-            if (!rans_uncompress_to_4x16(in+c_meta_len, in_size-c_meta_len, outN + idxN[i], &olen)
+            if (!rans_uncompress_to_4x16_ctx(ctx, in+c_meta_len,
+                                             in_size-c_meta_len,
+                                             outN + idxN[i], &olen)
                 || olen != ulenN[i]) {
-                free(out_free);
-                free(outN);
+                htscodecs_free(out_free);
+                rctx_free(ctx, outN);
                 return NULL;
             }
             c_meta_len += clenN[i];
@@ -1667,7 +2299,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
 
         unstripe(out, outN, ulen, N, idxN);
 
-        free(outN);
+        rctx_free(ctx, outN);
         *out_size = ulen;
         return out;
     }
@@ -1699,7 +2331,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
 
     if (!out) {
         *out_size = osz;
-        if (!(out = out_free = malloc(*out_size)))
+        if (!(out = out_free = htscodecs_malloc(*out_size)))
             return NULL;
     } else {
         if (*out_size < osz)
@@ -1737,7 +2369,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
     // followed by rANS compressed data.
 
     if (do_pack || do_rle) {
-        if (!(tmp = tmp_free = malloc(*out_size)))
+        if (!(tmp = tmp_free = rctx_alloc(ctx, *out_size)))
             goto err;
         if (do_pack && do_rle) {
             tmp1 = out;
@@ -1801,7 +2433,14 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
             sz += var_get_u32(in+sz, in_end, &c_meta_size);
             u_meta_size /= 2;
 
-            meta_free = meta = rans_dec_func(do_simd, 0)(in+sz, in_size-sz, NULL, u_meta_size);
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+            if (u_meta_size > 100000)
+                goto err;
+#endif
+            if (!(meta_free = rctx_alloc(ctx, u_meta_size)))
+                goto err;
+            meta = rans_dec_func(do_simd, 0)(in+sz, in_size-sz, meta_free,
+                                             u_meta_size);
             if (!meta)
                 goto err;
         }
@@ -1845,7 +2484,7 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
                             meta+1, rle_nsyms, tmp2, &unrle_size))
             goto err;
         tmp3_size = tmp2_size = unrle_size;
-        free(meta_free);
+        rctx_free(ctx, meta_free);
         meta_free = NULL;
     }
     if (do_pack) {
@@ -1859,19 +2498,29 @@ unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
         tmp3_size = unpacked_sz;
     }
 
-    if (tmp)
-        free(tmp);
+    rctx_free(ctx, tmp);
 
     *out_size = tmp3_size;
     return tmp3;
 
  err:
-    free(meta_free);
-    free(out_free);
-    free(tmp_free);
+    rctx_free(ctx, meta_free);
+    htscodecs_free(out_free);
+    rctx_free(ctx, tmp_free);
     return NULL;
 }
 
+unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
+                                       unsigned char *out, unsigned int *out_size) {
+    return rans_uncompress_to_4x16_ctx(NULL, in, in_size, out, out_size);
+}
+
+unsigned char *rans_uncompress_ctx(rans4x16_ctx *ctx,
+                                   unsigned char *in, unsigned int in_size,
+                                   unsigned char *out, unsigned int *out_size) {
+    return rans_uncompress_to_4x16_ctx(ctx, in, in_size, out, out_size);
+}
+
 unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
                                     unsigned int *out_size) {
     return rans_uncompress_to_4x16(in, in_size, NULL, out_size);
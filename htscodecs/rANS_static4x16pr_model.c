@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Static frequency models for rANS 4x16.
+ *
+ * Normally each rANS block carries its own frequency table, computed from
+ * the data being compressed.  For many small blocks with near identical
+ * statistics (eg successive CRAM slices) the cost of computing,
+ * normalising and storing these tables is significant.  Here we build a
+ * model once, serialise it separately, and then encode many blocks
+ * against it with only a model ID in each block.
+ *
+ * To ensure a model can encode data it wasn't built from, every symbol in
+ * the model alphabet has a non-zero frequency in every order-1 context.
+ * Blocks containing symbols outside of the alphabet are encoded as normal
+ * self-contained rANS 4x16 streams instead.
+ *
+ * Model serialisation:
+ *     u8    order (0 or 1)
+ *     u32v  model ID
+ *     ...   order-0: frequency table as encode_freq
+ *           order-1: alphabet, then one encode_freq_d table per context
+ *                    in the alphabet plus context 0.
+ *
+ * Block format:
+ *     u8    0: coded with model, or 1: plain rANS 4x16 stream follows
+ *     u32v  model ID
+ *     u32v  uncompressed size
+ *     ...   4 rANS states followed by the rANS data stream
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rANS_word.h"
+#include "rANS_static4x16.h"
+#include "rANS_static16_int.h"
+#include "varint.h"
+#include "utils.h"
+
+// Fixed 12-bit frequencies for both order-0 and order-1.
+#define TF_SHIFT_M 12
+#define TOTFREQ_M (1<<TF_SHIFT_M)
+
+#define MODEL_CODED 0
+#define MODEL_PLAIN 1
+
+struct rans4x16_model {
+    int order;
+    uint32_t id;
+    uint32_t A[256];             // alphabet; 1 if present
+    uint32_t (*F)[256];          // F[ctx][sym]; F[0] only for order-0
+
+    // Encoder symbols, [ctx][sym]
+    RansEncSymbol (*syms)[256];
+
+    // Decoder lookups; [ctx][freq] to symbol and [ctx][sym] to freq/base
+    uint8_t (*sfb)[TOTFREQ_M];
+    fb_t    (*fb)[256];
+};
+
+void rans4x16_model_destroy(rans4x16_model *m) {
+    if (!m)
+        return;
+
+    htscodecs_free(m->F);
+    htscodecs_free(m->syms);
+    htscodecs_free(m->sfb);
+    htscodecs_free(m->fb);
+    htscodecs_free(m);
+}
+
+unsigned int rans4x16_model_id(rans4x16_model *m) {
+    return m->id;
+}
+
+// Number of contexts in use; always 1 for order-0.
+static inline int model_nctx(rans4x16_model *m) {
+    return m->order ? 256 : 1;
+}
+
+// Is context i stored in the model?
+static inline int model_has_ctx(rans4x16_model *m, int i) {
+    return m->order ? (m->A[i] || i == 0) : i == 0;
+}
+
+// Allocates a model structure with empty frequencies
+static rans4x16_model *model_alloc(int order, uint32_t id) {
+    rans4x16_model *m = htscodecs_calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    m->order = order & 1;
+    m->id = id;
+    int nctx = model_nctx(m);
+    if (!(m->F = htscodecs_calloc(nctx, sizeof(*m->F)))) {
+        htscodecs_free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+// Validates the normalised frequencies and builds encoder and decoder
+// lookup tables from them.  Returns 0 on success, -1 on failure.
+static int model_build_tables(rans4x16_model *m) {
+    int i, j, nctx = model_nctx(m);
+
+    m->syms = htscodecs_calloc(nctx, sizeof(*m->syms));
+    m->sfb  = htscodecs_calloc(nctx, sizeof(*m->sfb));
+    m->fb   = htscodecs_calloc(nctx, sizeof(*m->fb));
+    if (!m->syms || !m->sfb || !m->fb)
+        return -1;
+
+    for (i = 0; i < nctx; i++) {
+        if (!model_has_ctx(m, i))
+            continue;
+
+        uint32_t x;
+        for (x = j = 0; j < 256; j++) {
+            // Every alphabet symbol must be encodable in every context
+            if (!m->A[j] != !m->F[i][j])
+                return -1;
+            if (!m->F[i][j])
+                continue;
+            if (m->F[i][j] > TOTFREQ_M - x)
+                return -1;
+
+            RansEncSymbolInit(&m->syms[i][j], x, m->F[i][j], TF_SHIFT_M);
+            memset(&m->sfb[i][x], j, m->F[i][j]);
+            m->fb[i][j].f = m->F[i][j];
+            m->fb[i][j].b = x;
+            x += m->F[i][j];
+        }
+        if (x != TOTFREQ_M)
+            return -1;
+    }
+
+    return 0;
+}
+
+rans4x16_model *rans4x16_model_build(unsigned char *in, unsigned int in_size,
+                                     int order, unsigned int id) {
+    int i, j;
+
+    if (in_size == 0 || in_size > INT_MAX)
+        return NULL;
+
+    rans4x16_model *m = model_alloc(order, id);
+    if (!m)
+        return NULL;
+
+    present8(in, in_size, m->A);
+    for (i = 0; i < 256; i++)
+        m->A[i] = m->A[i] != 0;
+
+    if (m->order == 0) {
+        if (htscodecs_hist8(in, in_size, m->F[0]) < 0)
+            goto err;
+    } else {
+        uint32_t T[256+MAGIC] = {0};
+        if (htscodecs_hist1_4(in, in_size, m->F, T) < 0)
+            goto err;
+
+        // Smooth so every alphabet symbol is encodable in every context
+        // we may be in.  The minimum frequency of unseen symbols after
+        // normalisation is 1, so this has little cost.
+        for (i = 0; i < 256; i++) {
+            if (!model_has_ctx(m, i)) {
+                memset(m->F[i], 0, sizeof(m->F[i]));
+                continue;
+            }
+            for (j = 0; j < 256; j++)
+                if (m->A[j] && !m->F[i][j])
+                    m->F[i][j] = 1;
+        }
+    }
+
+    for (i = 0; i < model_nctx(m); i++) {
+        if (!model_has_ctx(m, i))
+            continue;
+
+        uint32_t tot = 0;
+        for (j = 0; j < 256; j++)
+            tot += m->F[i][j];
+        if (normalise_freq(m->F[i], tot, TOTFREQ_M) < 0)
+            goto err;
+    }
+
+    if (model_build_tables(m) < 0)
+        goto err;
+
+    return m;
+
+ err:
+    rans4x16_model_destroy(m);
+    return NULL;
+}
+
+unsigned char *rans4x16_model_store(rans4x16_model *m,
+                                    unsigned int *out_size) {
+    // Worst case: 257 contexts of 256 5-byte values + alphabet
+    unsigned char *out = htscodecs_malloc(257*257*5 + 257*2 + 10), *cp = out;
+    if (!out)
+        return NULL;
+
+    int i;
+    *cp++ = m->order;
+    cp += var_put_u32(cp, NULL, m->id);
+
+    if (m->order == 0) {
+        cp += encode_freq(cp, m->F[0]);
+    } else {
+        cp += encode_alphabet(cp, m->A);
+        for (i = 0; i < 256; i++)
+            if (model_has_ctx(m, i))
+                cp += encode_freq_d(cp, m->A, m->F[i]);
+    }
+
+    *out_size = cp - out;
+    return out;
+}
+
+rans4x16_model *rans4x16_model_load(unsigned char *in, unsigned int in_size) {
+    unsigned char *cp = in, *cp_end = in + in_size;
+    uint32_t id, fsum;
+    int i, j, sz;
+
+    if (in_size < 2 || *in > 1)
+        return NULL;
+
+    int order = *cp++;
+    cp += var_get_u32(cp, cp_end, &id);
+
+    rans4x16_model *m = model_alloc(order, id);
+    if (!m)
+        return NULL;
+
+    if (m->order == 0) {
+        if (!(sz = decode_freq(cp, cp_end, m->F[0], &fsum))
+            || fsum != TOTFREQ_M)
+            goto err;
+        for (j = 0; j < 256; j++)
+            m->A[j] = m->F[0][j] != 0;
+    } else {
+        if (!(sz = decode_alphabet(cp, cp_end, m->A)))
+            goto err;
+        for (i = 0; i < 256; i++) {
+            if (!model_has_ctx(m, i))
+                continue;
+            cp += sz;
+            if (!(sz = decode_freq_d(cp, cp_end, m->A, m->F[i], &fsum))
+                || fsum != TOTFREQ_M)
+                goto err;
+        }
+    }
+
+    if (model_build_tables(m) < 0)
+        goto err;
+
+    return m;
+
+ err:
+    rans4x16_model_destroy(m);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Entropy encoders and decoders using a model.  These are the
+// rans_compress_O[01]_4x16 functions minus the frequency table handling.
+//
+// The compressed data is written backwards ending at out_end, returning
+// the start.
+static uint8_t *model_encode_O0(rans4x16_model *m,
+                                unsigned char *in, unsigned int in_size,
+                                uint8_t *out_end) {
+    RansEncSymbol *syms = m->syms[0];
+    RansState rans0, rans1, rans2, rans3;
+    uint8_t *ptr = out_end;
+    int i;
+
+    RansEncInit(&rans0);
+    RansEncInit(&rans1);
+    RansEncInit(&rans2);
+    RansEncInit(&rans3);
+
+    switch (i=(in_size&3)) {
+    case 3: RansEncPutSymbol(&rans2, &ptr, &syms[in[in_size-(i-2)]]);
+        // fall-through
+    case 2: RansEncPutSymbol(&rans1, &ptr, &syms[in[in_size-(i-1)]]);
+        // fall-through
+    case 1: RansEncPutSymbol(&rans0, &ptr, &syms[in[in_size-(i-0)]]);
+        // fall-through
+    case 0:
+        break;
+    }
+    for (i=(in_size &~3); i>0; i-=4) {
+        RansEncPutSymbol(&rans3, &ptr, &syms[in[i-1]]);
+        RansEncPutSymbol(&rans2, &ptr, &syms[in[i-2]]);
+        RansEncPutSymbol(&rans1, &ptr, &syms[in[i-3]]);
+        RansEncPutSymbol(&rans0, &ptr, &syms[in[i-4]]);
+    }
+
+    RansEncFlush(&rans3, &ptr);
+    RansEncFlush(&rans2, &ptr);
+    RansEncFlush(&rans1, &ptr);
+    RansEncFlush(&rans0, &ptr);
+
+    return ptr;
+}
+
+static uint8_t *model_encode_O1(rans4x16_model *m,
+                                unsigned char *in, unsigned int in_size,
+                                uint8_t *out_end) {
+    RansEncSymbol (*syms)[256] = m->syms;
+    RansState rans0, rans1, rans2, rans3;
+    uint8_t *ptr = out_end;
+
+    RansEncInit(&rans0);
+    RansEncInit(&rans1);
+    RansEncInit(&rans2);
+    RansEncInit(&rans3);
+
+    int isz4 = in_size>>2;
+    int i0 = 1*isz4-2;
+    int i1 = 2*isz4-2;
+    int i2 = 3*isz4-2;
+    int i3 = 4*isz4-2;
+
+    unsigned char l0 = in[i0+1];
+    unsigned char l1 = in[i1+1];
+    unsigned char l2 = in[i2+1];
+    unsigned char l3 = in[in_size-1];
+
+    // Deal with the remainder
+    for (i3 = in_size-2; i3 > 4*isz4-2; i3--) {
+        unsigned char c3 = in[i3];
+        RansEncPutSymbol(&rans3, &ptr, &syms[c3][l3]);
+        l3 = c3;
+    }
+
+    for (; i0 >= 0; i0--, i1--, i2--, i3--) {
+        unsigned char c0, c1, c2, c3;
+        RansEncSymbol *s3 = &syms[c3 = in[i3]][l3];
+        RansEncSymbol *s2 = &syms[c2 = in[i2]][l2];
+        RansEncSymbol *s1 = &syms[c1 = in[i1]][l1];
+        RansEncSymbol *s0 = &syms[c0 = in[i0]][l0];
+
+        RansEncPutSymbol(&rans3, &ptr, s3);
+        RansEncPutSymbol(&rans2, &ptr, s2);
+        RansEncPutSymbol(&rans1, &ptr, s1);
+        RansEncPutSymbol(&rans0, &ptr, s0);
+
+        l0 = c0;
+        l1 = c1;
+        l2 = c2;
+        l3 = c3;
+    }
+
+    RansEncPutSymbol(&rans3, &ptr, &syms[0][l3]);
+    RansEncPutSymbol(&rans2, &ptr, &syms[0][l2]);
+    RansEncPutSymbol(&rans1, &ptr, &syms[0][l1]);
+    RansEncPutSymbol(&rans0, &ptr, &syms[0][l0]);
+
+    RansEncFlush(&rans3, &ptr);
+    RansEncFlush(&rans2, &ptr);
+    RansEncFlush(&rans1, &ptr);
+    RansEncFlush(&rans0, &ptr);
+
+    return ptr;
+}
+
+static int model_decode_O0(rans4x16_model *m,
+                           unsigned char *in, unsigned int in_size,
+                           unsigned char *out, unsigned int out_sz) {
+    uint8_t *ssym = m->sfb[0];
+    fb_t *fb = m->fb[0];
+    uint8_t *cp = in, *cp_end = in + in_size - 8;
+    const uint32_t mask = TOTFREQ_M-1;
+    unsigned int i;
+
+    if (in_size < 16)
+        return -1;
+
+    RansState R[4];
+    RansDecInit(&R[0], &cp); if (R[0] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[1], &cp); if (R[1] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[2], &cp); if (R[2] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[3], &cp); if (R[3] < RANS_BYTE_L) return -1;
+
+    for (i = 0; cp < cp_end && i < (out_sz&~3); i+=4) {
+        uint32_t m0 = R[0] & mask, m1 = R[1] & mask;
+        uint32_t m2 = R[2] & mask, m3 = R[3] & mask;
+        uint8_t  c0 = ssym[m0], c1 = ssym[m1], c2 = ssym[m2], c3 = ssym[m3];
+
+        R[0] = fb[c0].f * (R[0] >> TF_SHIFT_M) + m0 - fb[c0].b;
+        R[1] = fb[c1].f * (R[1] >> TF_SHIFT_M) + m1 - fb[c1].b;
+        R[2] = fb[c2].f * (R[2] >> TF_SHIFT_M) + m2 - fb[c2].b;
+        R[3] = fb[c3].f * (R[3] >> TF_SHIFT_M) + m3 - fb[c3].b;
+
+        RansDecRenorm(&R[0], &cp);
+        RansDecRenorm(&R[1], &cp);
+        RansDecRenorm(&R[2], &cp);
+        RansDecRenorm(&R[3], &cp);
+
+        out[i+0] = c0;
+        out[i+1] = c1;
+        out[i+2] = c2;
+        out[i+3] = c3;
+    }
+
+    // remainder
+    for (; i < out_sz; i++) {
+        uint32_t m0 = R[i%4] & mask;
+        uint8_t  c0 = ssym[m0];
+        R[i%4] = fb[c0].f * (R[i%4] >> TF_SHIFT_M) + m0 - fb[c0].b;
+        RansDecRenormSafe(&R[i%4], &cp, cp_end+8);
+        out[i] = c0;
+    }
+
+    return 0;
+}
+
+static int model_decode_O1(rans4x16_model *m,
+                           unsigned char *in, unsigned int in_size,
+                           unsigned char *out, unsigned int out_sz) {
+    uint8_t (*sfb)[TOTFREQ_M] = m->sfb;
+    fb_t (*fb)[256] = m->fb;
+    uint8_t *ptr = in, *ptr_end = in + in_size - 8;
+    const uint32_t mask = TOTFREQ_M-1;
+
+    if (in_size < 16)
+        return -1;
+
+    RansState R[4];
+    RansDecInit(&R[0], &ptr); if (R[0] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[1], &ptr); if (R[1] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[2], &ptr); if (R[2] < RANS_BYTE_L) return -1;
+    RansDecInit(&R[3], &ptr); if (R[3] < RANS_BYTE_L) return -1;
+
+    unsigned int isz4 = out_sz>>2;
+    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
+    unsigned int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
+
+    for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
+        uint16_t m, c;
+        c = sfb[l0][m = R[0] & mask];
+        R[0] = fb[l0][c].f * (R[0]>>TF_SHIFT_M) + m - fb[l0][c].b;
+        out[i4[0]] = l0 = c;
+
+        c = sfb[l1][m = R[1] & mask];
+        R[1] = fb[l1][c].f * (R[1]>>TF_SHIFT_M) + m - fb[l1][c].b;
+        out[i4[1]] = l1 = c;
+
+        c = sfb[l2][m = R[2] & mask];
+        R[2] = fb[l2][c].f * (R[2]>>TF_SHIFT_M) + m - fb[l2][c].b;
+        out[i4[2]] = l2 = c;
+
+        c = sfb[l3][m = R[3] & mask];
+        R[3] = fb[l3][c].f * (R[3]>>TF_SHIFT_M) + m - fb[l3][c].b;
+        out[i4[3]] = l3 = c;
+
+        if (ptr < ptr_end) {
+            RansDecRenorm(&R[0], &ptr);
+            RansDecRenorm(&R[1], &ptr);
+            RansDecRenorm(&R[2], &ptr);
+            RansDecRenorm(&R[3], &ptr);
+        } else {
+            RansDecRenormSafe(&R[0], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[1], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[2], &ptr, ptr_end+8);
+            RansDecRenormSafe(&R[3], &ptr, ptr_end+8);
+        }
+    }
+
+    // Remainder
+    for (; i4[3] < out_sz; i4[3]++) {
+        uint32_t m3 = R[3] & mask;
+        unsigned char c3 = sfb[l3][m3];
+        out[i4[3]] = c3;
+        R[3] = fb[l3][c3].f * (R[3]>>TF_SHIFT_M) + m3 - fb[l3][c3].b;
+        RansDecRenormSafe(&R[3], &ptr, ptr_end + 8);
+        l3 = c3;
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+unsigned char *rans_compress_model_4x16(rans4x16_model *m,
+                                        unsigned char *in,
+                                        unsigned int in_size,
+                                        unsigned char *out,
+                                        unsigned int *out_size) {
+    unsigned char *out_free = NULL;
+    int i;
+
+    if (in_size > INT_MAX || (out && *out_size == 0)) {
+        *out_size = 0;
+        return NULL;
+    }
+
+    // Worst case model coding is TF_SHIFT_M bits per symbol.
+    uint64_t worst = (uint64_t)in_size * TF_SHIFT_M / 8 + 64;
+
+    if (!out) {
+        *out_size = rans_compress_bound_4x16(in_size, m->order) + 1;
+        if (*out_size < worst + 11)
+            *out_size = worst + 11;
+        if (!(out_free = out = htscodecs_malloc(*out_size))) {
+            *out_size = 0;
+            return NULL;
+        }
+    }
+
+    // Check data is encodable by this model.  Tiny inputs, where the
+    // order-1 split into 4 streams breaks down, also go via the normal
+    // encoder.
+    uint32_t P[256] = {0};
+    present8(in, in_size, P);
+    for (i = 0; i < 256; i++)
+        if (P[i] && !m->A[i])
+            break;
+
+    if (i < 256 || in_size < 8 || *out_size < 32)
+        goto plain;
+
+    // Header
+    unsigned char *cp = out, *out_end = out + *out_size;
+    *cp++ = MODEL_CODED;
+    cp += var_put_u32(cp, out_end, m->id);
+    cp += var_put_u32(cp, out_end, in_size);
+
+    // Entropy encode to the end of the buffer and move down.  If the
+    // buffer isn't large enough for the worst case we use a temporary
+    // one instead.
+    uint8_t *tmp = NULL, *enc_end = out_end;
+    if (out_end - cp < worst) {
+        if (!(tmp = htscodecs_malloc(worst)))
+            goto err;
+        enc_end = tmp + worst;
+    }
+    uint8_t *ptr = m->order
+        ? model_encode_O1(m, in, in_size, enc_end)
+        : model_encode_O0(m, in, in_size, enc_end);
+
+    // A poorly matching model may be larger than the input, in which
+    // case the normal encoder is more appropriate.
+    if (enc_end - ptr > out_end - cp || enc_end - ptr >= in_size) {
+        htscodecs_free(tmp);
+        goto plain;
+    }
+
+    memmove(cp, ptr, enc_end - ptr);
+    *out_size = (cp - out) + (enc_end - ptr);
+    htscodecs_free(tmp);
+
+    return out;
+
+ plain:
+    {
+        unsigned int osz = *out_size-1;
+        out[0] = MODEL_PLAIN;
+        if (!rans_compress_to_4x16(in, in_size, out+1, &osz, m->order))
+            goto err;
+        *out_size = osz+1;
+        return out;
+    }
+
+ err:
+    htscodecs_free(out_free);
+    *out_size = 0;
+    return NULL;
+}
+
+unsigned char *rans_uncompress_model_4x16(rans4x16_model **models,
+                                          int nmodels,
+                                          unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned char *out,
+                                          unsigned int *out_size) {
+    unsigned char *cp = in, *cp_end = in + in_size, *out_free = NULL;
+    uint32_t id, osz;
+    int i;
+
+    if (in_size < 1)
+        return NULL;
+
+    if (*cp == MODEL_PLAIN)
+        return rans_uncompress_to_4x16(in+1, in_size-1, out, out_size);
+    if (*cp++ != MODEL_CODED)
+        return NULL;
+
+    cp += var_get_u32(cp, cp_end, &id);
+    cp += var_get_u32(cp, cp_end, &osz);
+    if (cp >= cp_end || osz >= INT_MAX)
+        return NULL;
+
+    rans4x16_model *m = NULL;
+    for (i = 0; i < nmodels; i++) {
+        if (models[i] && models[i]->id == id) {
+            m = models[i];
+            break;
+        }
+    }
+    if (!m)
+        return NULL;
+
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    if (osz > 100000)
+        return NULL;
+#endif
+
+    if (!out) {
+        if (!(out_free = out = htscodecs_malloc(osz ? osz : 1)))
+            return NULL;
+    } else if (*out_size < osz) {
+        return NULL;
+    }
+
+    int err = m->order
+        ? model_decode_O1(m, cp, cp_end - cp, out, osz)
+        : model_decode_O0(m, cp, cp_end - cp, out, osz);
+    if (err < 0) {
+        htscodecs_free(out_free);
+        return NULL;
+    }
+
+    *out_size = osz;
+    return out;
+}
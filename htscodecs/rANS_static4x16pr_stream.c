@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Streaming decoder for rANS 4x16 and 32x16 order-0 and order-1 data.
+ *
+ * The normal decoders need the entire uncompressed block in memory at
+ * once.  Here the caller instead pulls the data out a chunk at a time,
+ * with at most buf_size bytes of uncompressed data held internally.
+ *
+ * Order-0 interleaves the N states symbol by symbol, so this is a
+ * straight forward single pass over the input.
+ *
+ * Order-1 splits the output into N equal sized segments, one per state,
+ * with the remainder being appended to the last.  All states share one
+ * input pointer, so segment z cannot be produced without also decoding
+ * the first part of every other segment.  We therefore decode in one or
+ * more passes, each starting from the initial states and keeping the
+ * output for only as many segments as fit in our buffer.  If a single
+ * segment is larger than the buffer then it is produced in windows
+ * during its pass.  The cost is roughly one full decode per buf_size
+ * bytes of output, so buf_size should be as large as is tolerable.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rANS_word.h"
+#include "rANS_static4x16.h"
+#include "rANS_static16_int.h"
+#include "varint.h"
+#include "utils.h"
+
+#define STREAM_NX_MAX 32
+#define STREAM_BUF_DEFAULT (8<<20)
+#define STREAM_BUF_MIN 1024
+
+struct rans4x16_stream {
+    uint8_t *ptr0, *ptr, *in_end; // rANS data start, current and end
+    int N;                        // number of states; 4 or 32
+    int order;                    // 0, 1 or -1 for CAT
+    int err;
+    uint32_t out_sz;              // total uncompressed size
+    uint32_t out_pos;             // amount returned so far
+    uint8_t *ck;                  // checkpoint index, if any
+    uint32_t nck, ck_len, K;      // count, record size and step interval
+    RansState R0[STREAM_NX_MAX];  // initial states, for restarting passes
+    RansState R[STREAM_NX_MAX];
+
+    // Order-0
+    uint32_t s3[TOTFREQ];
+
+    // Order-1; s3F overlaps sfb/fb
+    int shift;
+    uint8_t *sfb_;
+    uint8_t *sfb[256];
+    fb_t (*fb)[256];
+    uint32_t (*s3F)[TOTFREQ_O1_FAST];
+    uint8_t l[STREAM_NX_MAX];     // last symbol per state
+    uint32_t isz;                 // size of each order-1 segment
+    uint32_t t;                   // steps decoded in the current pass
+    int z0, G;                    // segments kept this pass, [z0, z0+G)
+    int in_pass;
+
+    // Decoded, but not yet returned, data
+    uint8_t *buf;
+    uint32_t W;                   // window size
+    uint32_t buf_pos, buf_len;
+};
+
+static int stream_init_O0(rans4x16_stream *s, uint8_t *cp, uint8_t *cp_end) {
+    uint32_t F[256] = {0}, fsum;
+    int fsz = decode_freq(cp, cp_end, F, &fsum);
+    if (!fsz)
+        return -1;
+    cp += fsz;
+
+    normalise_freq_shift(F, fsum, TOTFREQ);
+    if (rans_F_to_s3(F, TF_SHIFT, s->s3))
+        return -1;
+
+    s->ptr0 = cp;
+    return 0;
+}
+
+static int stream_init_O1(rans4x16_stream *s, uint8_t *cp, uint8_t *cp_end) {
+    unsigned char *c_freq = NULL, *c_freq_end = cp_end, *tab_end = NULL;
+    int i;
+
+    s->shift = *cp >> 4;
+    if (s->shift != TF_SHIFT_O1 && s->shift != TF_SHIFT_O1_FAST)
+        return -1;
+
+    // sfb and fb are consecutive, with s3F overlapping them
+    s->sfb_ = htscodecs_calloc(256, TOTFREQ_O1 + 256*sizeof(fb_t));
+    if (!s->sfb_)
+        return -1;
+    for (i = 0; i < 256; i++)
+        s->sfb[i] = s->sfb_ + i*TOTFREQ_O1;
+    s->fb  = (fb_t (*)[256])(s->sfb_ + 256*TOTFREQ_O1);
+    s->s3F = (uint32_t (*)[TOTFREQ_O1_FAST])s->sfb_;
+
+    // compressed header? If so uncompress it
+    if (*cp++ & 1) {
+        uint32_t u_freq_sz, c_freq_sz;
+        cp += var_get_u32(cp, cp_end, &u_freq_sz);
+        cp += var_get_u32(cp, cp_end, &c_freq_sz);
+        if (c_freq_sz > cp_end - cp)
+            return -1;
+        tab_end = cp + c_freq_sz;
+        if (!(c_freq = rans_uncompress_O0_4x16(cp, c_freq_sz, NULL,
+                                               u_freq_sz)))
+            return -1;
+        cp = c_freq;
+        c_freq_end = c_freq + u_freq_sz;
+    }
+
+    int fsz = s->shift == TF_SHIFT_O1
+        ? decode_freq1(cp, c_freq_end, s->shift, NULL, NULL, s->sfb, s->fb)
+        : decode_freq1(cp, c_freq_end, s->shift, NULL, s->s3F, NULL, NULL);
+    htscodecs_free(c_freq);
+    if (!fsz)
+        return -1;
+
+    s->ptr0 = tab_end ? tab_end : cp + fsz;
+    return 0;
+}
+
+// Parses the header and frequency tables of a plain order-0 or order-1
+// stream, or CAT, leaving s->R0 and s->ptr0 at the start of the data.
+// A RANS_CKPT_MAGIC container has its checkpoint index recorded in s->ck.
+static rans4x16_stream *stream_open(unsigned char *in, unsigned int in_size) {
+    unsigned char *in_end = in + in_size;
+    rans4x16_stream *s;
+    int z;
+
+    if (in_size == 0)
+        return NULL;
+
+    if (!(s = htscodecs_calloc(1, sizeof(*s))))
+        return NULL;
+
+    if (*in == RANS_CKPT_MAGIC) {
+        uint32_t idx_sz;
+        in++;
+        in += var_get_u32(in, in_end, &s->K);
+        in += var_get_u32(in, in_end, &s->nck);
+        in += var_get_u32(in, in_end, &idx_sz);
+        if (idx_sz >= in_end - in)
+            goto err;
+        s->ck = in;
+        in += idx_sz;
+        if (s->K == 0 || (s->nck && idx_sz % s->nck))
+            goto err;
+        s->ck_len = s->nck ? idx_sz / s->nck : 0;
+    }
+
+    int order = *in++;
+    if (order & (RANS_ORDER_PACK | RANS_ORDER_RLE |
+                 RANS_ORDER_STRIPE | RANS_ORDER_NOSZ))
+        goto err;
+
+    s->N = (order & RANS_ORDER_X32) ? 32 : 4;
+    s->order = (order & RANS_ORDER_CAT) ? -1 : (order & 1);
+    in += var_get_u32(in, in_end, &s->out_sz);
+    s->in_end = in_end;
+
+    if (s->out_sz >= INT_MAX)
+        goto err;
+
+    if (in >= in_end) {
+        // No rANS data, as per rans_uncompress_to_4x16
+        s->out_sz = 0;
+        s->nck = 0;
+        return s;
+    }
+
+    if (s->order < 0) {
+        if (s->out_sz > in_end - in)
+            goto err;
+        s->ptr0 = in;
+        s->nck = 0;
+        return s;
+    }
+
+    if ((s->order == 0 ? stream_init_O0(s, in, in_end)
+                       : stream_init_O1(s, in, in_end)) < 0)
+        goto err;
+
+    if (s->ptr0 > in_end || in_end - s->ptr0 < s->N * 4)
+        goto err;
+
+    s->ptr = s->ptr0;
+    for (z = 0; z < s->N; z++) {
+        RansDecInit(&s->R0[z], &s->ptr);
+        if (s->R0[z] < RANS_BYTE_L)
+            goto err;
+    }
+    s->ptr0 = s->ptr;
+    memcpy(s->R, s->R0, sizeof(s->R));
+    s->isz = s->out_sz / s->N;
+
+    if (s->nck && s->ck_len != 4 + 4*s->N + (s->order ? s->N : 0))
+        goto err;
+
+    return s;
+
+ err:
+    htscodecs_free(s->sfb_);
+    htscodecs_free(s);
+    return NULL;
+}
+
+/*
+ * Prepares to decode a rANS 4x16 block.  Only plain order-0 and order-1
+ * streams, with 4 or 32 states, and CAT are supported.  The PACK, RLE
+ * and STRIPE transforms, along with RANS_ORDER_PARALLEL containers,
+ * return NULL.
+ *
+ * buf_size limits the amount of decoded data held at any one time.  Zero
+ * means use the default of 8MB.
+ *
+ * The input buffer must remain valid until rans4x16_stream_finish.
+ */
+rans4x16_stream *rans4x16_stream_init(unsigned char *in, unsigned int in_size,
+                                      unsigned int buf_size) {
+    rans4x16_stream *s = stream_open(in, in_size);
+    if (!s)
+        return NULL;
+
+    if (buf_size == 0)
+        buf_size = STREAM_BUF_DEFAULT;
+    if (buf_size < STREAM_BUF_MIN)
+        buf_size = STREAM_BUF_MIN;
+
+    uint32_t alloc = 0;
+    if (s->order == 0) {
+        // Windows are whole steps of N symbols
+        s->W = buf_size - buf_size % s->N;
+        alloc = s->W < s->out_sz ? s->W : s->out_sz;
+    } else if (s->order == 1) {
+        if (s->isz == 0) {
+            s->G = s->N;
+            s->W = 0;
+        } else if (s->isz <= buf_size) {
+            s->G = buf_size / s->isz;
+            if (s->G > s->N)
+                s->G = s->N;
+            s->W = s->isz;
+        } else {
+            s->G = 1;
+            s->W = buf_size;
+        }
+        // Plus room for the remainder after the last segment
+        alloc = s->G * s->W + s->N;
+    }
+
+    if (!(s->buf = htscodecs_malloc(alloc ? alloc : 1))) {
+        rans4x16_stream_finish(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+unsigned int rans4x16_stream_size(rans4x16_stream *s) {
+    return s->out_sz;
+}
+
+// Decodes len order-0 symbols to out, starting from a whole step.
+// Only the last step may be partial.
+static void stream_decode_O0(rans4x16_stream *s, uint8_t *out,
+                             uint32_t len) {
+    const uint32_t mask = (1u << TF_SHIFT)-1;
+    uint8_t *ptr = s->ptr, *ptr_end = s->in_end;
+    RansState R[STREAM_NX_MAX];
+    uint32_t i;
+    int z, N = s->N;
+
+    memcpy(R, s->R, N * sizeof(*R));
+
+    for (i = 0; i + N <= len; i += N) {
+        for (z = 0; z < N; z++) {
+            uint32_t S = s->s3[R[z] & mask];
+            R[z] = (S>>(TF_SHIFT+8)) * (R[z] >> TF_SHIFT) + ((S>>8) & mask);
+            out[i+z] = S;
+            RansDecRenormSafe(&R[z], &ptr, ptr_end);
+        }
+    }
+    for (z = 0; i < len; i++, z++)
+        out[i] = s->s3[R[z] & mask];
+
+    memcpy(s->R, R, N * sizeof(*R));
+    s->ptr = ptr;
+}
+
+// Decodes the next window of order-0 data into s->buf.
+static void stream_fill_O0(rans4x16_stream *s) {
+    uint32_t len = s->out_sz - s->out_pos; // buffer is empty
+    if (len > s->W)
+        len = s->W;
+
+    stream_decode_O0(s, s->buf, len);
+    s->buf_pos = 0;
+    s->buf_len = len;
+}
+
+// Decodes nsteps symbols from each order-1 state in [za, zb).
+// State z writes to dst[z], or discards its output if dst[z] is NULL.
+static void stream_steps_O1(rans4x16_stream *s, uint32_t nsteps,
+                            int za, int zb, uint8_t **dst) {
+    uint8_t *ptr = s->ptr, *ptr_end = s->in_end;
+    RansState R[STREAM_NX_MAX];
+    uint8_t l[STREAM_NX_MAX], junk;
+    uint8_t *p[STREAM_NX_MAX];
+    int inc[STREAM_NX_MAX];
+    uint32_t t;
+    int z, N = s->N;
+
+    memcpy(R, s->R, N * sizeof(*R));
+    memcpy(l, s->l, N);
+    for (z = za; z < zb; z++) {
+        p[z]   = dst[z] ? dst[z] : &junk;
+        inc[z] = dst[z] != NULL;
+    }
+
+    if (s->shift == TF_SHIFT_O1) {
+        const uint32_t mask = (1u << TF_SHIFT_O1)-1;
+        for (t = 0; t < nsteps; t++) {
+            for (z = za; z < zb; z++) {
+                uint32_t m = R[z] & mask;
+                uint8_t c = s->sfb[l[z]][m];
+                R[z] = s->fb[l[z]][c].f * (R[z]>>TF_SHIFT_O1)
+                    + m - s->fb[l[z]][c].b;
+                *p[z] = l[z] = c;
+                p[z] += inc[z];
+                RansDecRenormSafe(&R[z], &ptr, ptr_end);
+            }
+        }
+    } else {
+        const uint32_t mask = (1u << TF_SHIFT_O1_FAST)-1;
+        for (t = 0; t < nsteps; t++) {
+            for (z = za; z < zb; z++) {
+                uint32_t S = s->s3F[l[z]][R[z] & mask];
+                R[z] = (S>>(TF_SHIFT_O1_FAST+8)) * (R[z]>>TF_SHIFT_O1_FAST)
+                    + ((S>>8) & mask);
+                *p[z] = l[z] = S;
+                p[z] += inc[z];
+                RansDecRenormSafe(&R[z], &ptr, ptr_end);
+            }
+        }
+    }
+
+    memcpy(s->R, R, N * sizeof(*R));
+    memcpy(s->l, l, N);
+    s->ptr = ptr;
+}
+
+// Decodes the next window of order-1 data into s->buf.
+static int stream_fill_O1(rans4x16_stream *s) {
+    uint8_t *dst[STREAM_NX_MAX] = {0};
+    int z;
+
+    if (s->z0 >= s->N)
+        return -1;
+
+    if (!s->in_pass) {
+        memcpy(s->R, s->R0, sizeof(s->R));
+        memset(s->l, 0, sizeof(s->l));
+        s->ptr = s->ptr0;
+        s->t = 0;
+        s->in_pass = 1;
+    }
+
+    int G = s->z0 + s->G > s->N ? s->N - s->z0 : s->G;
+    for (z = 0; z < G; z++)
+        dst[s->z0 + z] = s->buf + z * s->W;
+
+    uint32_t len = s->isz - s->t < s->W ? s->isz - s->t : s->W;
+    stream_steps_O1(s, len, 0, s->N, dst);
+    s->t += len;
+
+    s->buf_pos = 0;
+    s->buf_len = (G-1) * s->W + len;
+    if (s->t == s->isz) {
+        if (s->z0 + G == s->N) {
+            // The remainder belongs to the last state
+            uint32_t tail = s->out_sz - s->N * s->isz;
+            dst[s->N-1] = s->buf + s->buf_len;
+            stream_steps_O1(s, tail, s->N-1, s->N, dst);
+            s->buf_len += tail;
+        }
+        s->z0 += G;
+        s->in_pass = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Copies up to n bytes of decoded data to out.
+ *
+ * Returns the number of bytes written, 0 once all data has been returned,
+ * or -1 on error.
+ */
+int rans4x16_stream_next(rans4x16_stream *s, unsigned char *out,
+                         unsigned int n) {
+    unsigned int done = 0;
+
+    if (s->err)
+        return -1;
+
+    if (n > INT_MAX)
+        n = INT_MAX;
+
+    if (s->order < 0) {
+        // CAT; copy directly from the input
+        if (n > s->out_sz - s->out_pos)
+            n = s->out_sz - s->out_pos;
+        memcpy(out, s->ptr0 + s->out_pos, n);
+        s->out_pos += n;
+        return n;
+    }
+
+    while (done < n) {
+        if (s->buf_pos == s->buf_len) {
+            if (s->out_pos == s->out_sz)
+                break;
+            if (s->order == 0)
+                stream_fill_O0(s);
+            else if (stream_fill_O1(s) < 0)
+                s->buf_len = 0;
+            if (s->buf_len == 0) {
+                s->err = 1;
+                return -1;
+            }
+        }
+
+        uint32_t len = s->buf_len - s->buf_pos;
+        if (len > n - done)
+            len = n - done;
+        memcpy(out + done, s->buf + s->buf_pos, len);
+        s->buf_pos += len;
+        s->out_pos += len;
+        done += len;
+    }
+
+    return done;
+}
+
+/*
+ * Frees the stream.  Returns 0 on success, or -1 if an error was
+ * encountered while decoding.
+ */
+int rans4x16_stream_finish(rans4x16_stream *s) {
+    if (!s)
+        return 0;
+
+    int ret = s->err ? -1 : 0;
+    htscodecs_free(s->buf);
+    htscodecs_free(s->sfb_);
+    htscodecs_free(s);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Random access via checkpoints.
+ *
+ * A checkpoint is a snapshot of the decoder every K steps (K*N symbols):
+ * the input offset, all N states and for order-1 the previous symbol of
+ * each state.  We obtain these by decoding the freshly encoded stream,
+ * which keeps them independent of the (many) encoder implementations.
+ *
+ * Format:
+ *     u8     RANS_CKPT_MAGIC (never emitted otherwise)
+ *     u32v   K, the checkpoint interval in steps
+ *     u32v   number of checkpoints, at steps K, 2K, 3K, ...
+ *     u32v   size of the checkpoint index
+ *     ...    checkpoints, each:
+ *              u32  input offset relative to the end of the initial states
+ *              u32  each of the N states
+ *              u8   each of the N previous symbols (order-1 only)
+ *     ...    plain order-0 or order-1 rANS 4x16 stream
+ *
+ * Decoding a range starts from the last checkpoint at or before it, so
+ * at most K*N symbols are decoded and discarded.
+ */
+
+static inline void u32_put(uint8_t *cp, uint32_t v) {
+    cp[0] = v;
+    cp[1] = v >> 8;
+    cp[2] = v >> 16;
+    cp[3] = v >> 24;
+}
+
+static inline uint32_t u32_get(uint8_t *cp) {
+    return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+}
+
+// Sets the decoder state to checkpoint j, with 0 being the start.
+static int stream_ckpt_load(rans4x16_stream *s, uint32_t j) {
+    int z;
+
+    if (j == 0) {
+        memcpy(s->R, s->R0, sizeof(s->R));
+        memset(s->l, 0, sizeof(s->l));
+        s->ptr = s->ptr0;
+        return 0;
+    }
+
+    uint8_t *cp = s->ck + (uint64_t)(j-1) * s->ck_len;
+    uint32_t off = u32_get(cp);
+    if (off > s->in_end - s->ptr0)
+        return -1;
+    s->ptr = s->ptr0 + off;
+    for (z = 0, cp += 4; z < s->N; z++, cp += 4)
+        s->R[z] = u32_get(cp);
+    if (s->order == 1)
+        memcpy(s->l, cp, s->N);
+
+    return 0;
+}
+
+/*
+ * Builds the checkpoint header for a plain order-0 or order-1 rANS 4x16
+ * stream, with checkpoints approximately every "interval" bytes.
+ *
+ * Returns a malloced header, to be followed by "in", with its size in
+ * *hdr_size.  Returns NULL if "in" is an unsupported type or too small
+ * to benefit.
+ */
+unsigned char *rans4x16_ckpt_header(unsigned char *in, unsigned int in_size,
+                                    unsigned int interval,
+                                    unsigned int *hdr_size) {
+    rans4x16_stream *s = stream_open(in, in_size);
+    unsigned char *hdr = NULL, *scratch = NULL, *cp, *hdr_end;
+    uint8_t *dst[STREAM_NX_MAX] = {0};
+    uint32_t j, nck, K, tmax;
+    int z, rec;
+
+    if (!s || s->order < 0 || s->ck)
+        goto err;
+
+    K = interval / s->N ? interval / s->N : 1;
+    tmax = s->order ? s->isz : s->out_sz / s->N;
+    nck = tmax ? (tmax-1) / K : 0;
+    if (nck == 0)
+        goto err;
+
+    rec = 4 + 4*s->N + (s->order ? s->N : 0);
+    if (!(hdr = htscodecs_malloc(16 + (uint64_t)nck * rec)))
+        goto err;
+    if (s->order == 0 && !(scratch = htscodecs_malloc((uint64_t)K * s->N)))
+        goto err;
+
+    hdr_end = hdr + 16 + (uint64_t)nck * rec;
+    cp = hdr;
+    *cp++ = RANS_CKPT_MAGIC;
+    cp += var_put_u32(cp, hdr_end, K);
+    cp += var_put_u32(cp, hdr_end, nck);
+    cp += var_put_u32(cp, hdr_end, nck * rec);
+
+    for (j = 0; j < nck; j++) {
+        if (s->order == 0)
+            stream_decode_O0(s, scratch, K * s->N);
+        else
+            stream_steps_O1(s, K, 0, s->N, dst);
+
+        u32_put(cp, s->ptr - s->ptr0);
+        for (z = 0, cp += 4; z < s->N; z++, cp += 4)
+            u32_put(cp, s->R[z]);
+        if (s->order) {
+            memcpy(cp, s->l, s->N);
+            cp += s->N;
+        }
+    }
+
+    htscodecs_free(scratch);
+    rans4x16_stream_finish(s);
+    *hdr_size = cp - hdr;
+    return hdr;
+
+ err:
+    htscodecs_free(hdr);
+    htscodecs_free(scratch);
+    rans4x16_stream_finish(s);
+    return NULL;
+}
+
+// Decodes order-1 positions [start, end) of a single state's segment.
+static int stream_range_O1(rans4x16_stream *s, uint32_t start, uint32_t end,
+                           uint8_t *out) {
+    uint8_t *dst[STREAM_NX_MAX] = {0}, *tmp;
+    int N = s->N;
+    int z = s->isz ? start / s->isz : N-1;
+    if (z > N-1)
+        z = N-1;
+
+    uint32_t ta = start - z * s->isz, tb = end - z * s->isz;
+    uint32_t j = (ta < s->isz ? ta : s->isz) / s->K;
+    if (j > s->nck)
+        j = s->nck;
+    if (stream_ckpt_load(s, j) < 0)
+        return -1;
+
+    uint32_t t = j * s->K;
+    if (!(tmp = htscodecs_malloc(tb - t)))
+        return -1;
+
+    dst[z] = tmp;
+    stream_steps_O1(s, (tb < s->isz ? tb : s->isz) - t, 0, N, dst);
+    if (tb > s->isz) {
+        // The remainder belongs to the last state
+        dst[N-1] = tmp + (s->isz - t);
+        stream_steps_O1(s, tb - s->isz, N-1, N, dst);
+    }
+
+    memcpy(out, tmp + (ta - t), tb - ta);
+    htscodecs_free(tmp);
+    return 0;
+}
+
+/*
+ * Decodes len bytes starting at offset start of the uncompressed data,
+ * into out or a malloced buffer if out is NULL.
+ *
+ * Returns the decoded data on success, or NULL if the range is beyond the
+ * end of the data or on error.
+ */
+unsigned char *rans_uncompress_range_4x16(unsigned char *in,
+                                          unsigned int in_size,
+                                          unsigned int start,
+                                          unsigned int len,
+                                          unsigned char *out) {
+    unsigned char *out_free = NULL, *tmp = NULL;
+    rans4x16_stream *s = stream_open(in, in_size);
+
+    if (!s) {
+        // No random access, so decode the lot
+        unsigned int usize;
+        unsigned char *u = rans_uncompress_4x16(in, in_size, &usize);
+        if (!u || (uint64_t)start + len > usize) {
+            htscodecs_free(u);
+            return NULL;
+        }
+        if (!out && !(out = htscodecs_malloc(len ? len : 1))) {
+            htscodecs_free(u);
+            return NULL;
+        }
+        memcpy(out, u + start, len);
+        htscodecs_free(u);
+        return out;
+    }
+
+    if ((uint64_t)start + len > s->out_sz)
+        goto err;
+    if (!out && !(out_free = out = htscodecs_malloc(len ? len : 1)))
+        goto err;
+    if (!s->K)
+        s->K = UINT_MAX;
+
+    if (s->order < 0) {
+        memcpy(out, s->ptr0 + start, len);
+    } else if (s->order == 0) {
+        uint32_t j = start / s->N / s->K;
+        if (j > s->nck)
+            j = s->nck;
+        if (stream_ckpt_load(s, j) < 0)
+            goto err;
+
+        uint32_t skip = start - j * s->K * s->N;
+        if (!(tmp = htscodecs_malloc(skip + len ? skip + len : 1)))
+            goto err;
+        stream_decode_O0(s, tmp, skip + len);
+        memcpy(out, tmp + skip, len);
+    } else {
+        // One piece per state segment overlapping the range
+        uint32_t p = start, end = start + len;
+        while (p < end) {
+            uint32_t z = s->isz ? p / s->isz : s->N-1;
+            uint32_t seg_end = z >= s->N-1 ? s->out_sz : (z+1) * s->isz;
+            if (seg_end > end)
+                seg_end = end;
+            if (stream_range_O1(s, p, seg_end, out + (p - start)) < 0)
+                goto err;
+            p = seg_end;
+        }
+    }
+
+    htscodecs_free(tmp);
+    rans4x16_stream_finish(s);
+    return out;
+
+ err:
+    htscodecs_free(tmp);
+    htscodecs_free(out_free);
+    rans4x16_stream_finish(s);
+    return NULL;
+}
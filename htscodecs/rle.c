@@ -40,6 +40,7 @@
 
 #include "varint.h"
 #include "rle.h"
+#include "htscodecs.h"
 
 #define MAGIC 8
 
@@ -103,7 +104,7 @@ uint8_t *hts_rle_encode(uint8_t *data, uint64_t data_len,
                         uint8_t *out, uint64_t *out_len) {
     uint64_t i, j, k;
     if (!out)
-        if (!(out = malloc(data_len*2)))
+        if (!(out = htscodecs_malloc(data_len*2)))
             return NULL;
 
     // Two pass:  Firstly compute which symbols are worth using RLE on.
@@ -44,9 +44,17 @@ extern "C" {
  * Use the "last_start_p" return value to identify the partial line start
  * offset, for continuation purposes.
  *
+ * Encoding fails if a name has more than 128 tokens, as older decoders
+ * cannot read such data.  Setting TOK3_LONG_NAMES in level raises this
+ * to 256, for long PacBio or ONT style names, but the output can then
+ * only be decoded by this or later versions.  This applies to all of
+ * the tok3_encode_names functions.
+ *
  * Returns a malloced buffer holding compressed data of size *out_len,
  *         or NULL on failure
  */
+#define TOK3_LONG_NAMES (1<<8)
+
 uint8_t *tok3_encode_names(char *blk, int len, int level, int use_arith,
                            int *out_len, int *last_start_p);
 
@@ -58,6 +66,92 @@ uint8_t *tok3_encode_names(char *blk, int len, int level, int use_arith,
  */
 uint8_t *tok3_decode_names(uint8_t *in, uint32_t sz, uint32_t *out_len);
 
+/*
+ * As tok3_encode_names and tok3_decode_names, but compressing or
+ * decompressing the per-token descriptor streams using up to nthreads
+ * threads.  When encoding, each compression method trialled for each
+ * stream is a separate job.  The output is identical to the single
+ * threaded functions.
+ */
+uint8_t *tok3_encode_names_mt(char *blk, int len, int level, int use_arith,
+                              int *out_len, int *last_start_p, int nthreads);
+
+uint8_t *tok3_decode_names_mt(uint8_t *in, uint32_t sz, uint32_t *out_len,
+                              int nthreads);
+
+/*
+ * Decodes a compressed block of read names into a caller supplied
+ * buffer, avoiding the allocation made by tok3_decode_names and the need
+ * to scan its output for the start of each name.
+ *
+ * tok3_decode_names_size reports the size of out needed, which includes
+ * some working space beyond the names themselves, and the number of
+ * names in the block.
+ *
+ * tok3_decode_names_to writes \0 separated names to out, as per
+ * tok3_decode_names, using up to nthreads threads.  The start of name i
+ * within out and its length, excluding the \0, are stored in offsets[i]
+ * and lengths[i], which have room for max_names entries.  The number of
+ * bytes written to out and the number of names are returned in *out_len
+ * and *nnames.
+ *
+ * Both return 0 on success,
+ *            -1 on failure, including if out or offsets are too small.
+ */
+int tok3_decode_names_size(uint8_t *in, uint32_t sz, uint32_t *out_size,
+                           uint32_t *nnames);
+
+int tok3_decode_names_to(uint8_t *in, uint32_t sz,
+                         uint8_t *out, uint32_t out_size,
+                         uint32_t *offsets, uint32_t *lengths,
+                         uint32_t max_names, uint32_t *out_len,
+                         uint32_t *nnames, int nthreads);
+
+/*
+ * Decodes only the numeric fields of a compressed block of read names,
+ * such as the tile and x/y coordinates, without building the names.
+ * Descriptor streams for other tokens are not decompressed.
+ *
+ * tokens[] holds ntokens token numbers, as assigned by the encoder.
+ * Token 1 is the start of the name.  Each token is a letter followed by
+ * any more letters and punctuation, up to 9 digits, or one other
+ * character.  Some known formats start with a fixed length token
+ * instead.  For Illumina names of the form
+ * "instrument:run:flowcell:lane:tile:x:y" the part before the lane is
+ * token 1, so the lane, tile, x and y are tokens 2, 4, 6 and 8.
+ *
+ * The returned array holds ntokens values per name, in name order, with
+ * -1 for tokens that are absent or not numeric in that name.  The number
+ * of names is returned in *nnames.
+ *
+ * Returns a malloced array on success,
+ *         NULL on failure.
+ */
+int64_t *tok3_decode_fields(uint8_t *in, uint32_t sz, const int *tokens,
+                            int ntokens, uint32_t *nnames);
+
+/*
+ * A persistent encoder context, holding the memory used by
+ * tok3_encode_names so that it is reused rather than reallocated
+ * when encoding many blocks.  The memory grows to the largest block
+ * seen and is released by tok3_enc_ctx_destroy.
+ *
+ * A context must not be used by more than one thread at a time, but
+ * tok3_enc_ctx_set_threads permits each tok3_encode_names_ctx call to
+ * compress its descriptors using multiple threads, as per
+ * tok3_encode_names_mt.  A NULL ctx is permitted and is equivalent to
+ * calling tok3_encode_names.  The output is identical in all cases.
+ */
+typedef struct tok3_enc_ctx tok3_enc_ctx;
+
+tok3_enc_ctx *tok3_enc_ctx_create(void);
+void tok3_enc_ctx_destroy(tok3_enc_ctx *ctx);
+void tok3_enc_ctx_set_threads(tok3_enc_ctx *ctx, int nthreads);
+
+uint8_t *tok3_encode_names_ctx(tok3_enc_ctx *ctx, char *blk, int len,
+                               int level, int use_arith, int *out_len,
+                               int *last_start_p);
+
 #ifdef __cplusplus
 }
 #endif
@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 
 #include "utils.h"
 
@@ -94,10 +95,10 @@ static void htscodecs_tls_free_all(void *ptr) {
         if (tls->used[i]) {
             fprintf(stderr, "Closing thread while TLS data is in use\n");
         }
-        free(tls->bufs[i]);
+        htscodecs_free(tls->bufs[i]);
     }
 
-    free(tls);
+    htscodecs_free(tls);
 }
 
 static void htscodecs_tls_init(void) {
@@ -129,7 +130,7 @@ void *htscodecs_tls_alloc(size_t size) {
     // Initialise tls_pool on first usage
     tls_pool *tls = pthread_getspecific(rans_key);
     if (!tls) {
-        if (!(tls = calloc(1, sizeof(*tls))))
+        if (!(tls = htscodecs_calloc(1, sizeof(*tls))))
             return NULL;
         pthread_setspecific(rans_key, tls);
     }
@@ -158,8 +159,8 @@ void *htscodecs_tls_alloc(size_t size) {
     }
 
     if (tls->bufs[avail])
-        free(tls->bufs[avail]);
-    if (!(tls->bufs[avail] = calloc(1, size)))
+        htscodecs_free(tls->bufs[avail]);
+    if (!(tls->bufs[avail] = htscodecs_calloc(1, size)))
         return NULL;
 #ifdef TLS_DEBUG
     fprintf(stderr, "Alloc %d: %ld = %p\n", avail, size, tls->bufs[avail]);
@@ -221,14 +222,311 @@ void htscodecs_tls_free(void *ptr) {
  * before freeing it to ensure it's never visible to a subsequent malloc.)
  */
 void *htscodecs_tls_alloc(size_t size) {
-    return calloc(1, size);
+    return htscodecs_calloc(1, size);
 }
 
 void *htscodecs_tls_calloc(size_t nmemb, size_t size) {
-    return calloc(nmemb, size);
+    return htscodecs_calloc(nmemb, size);
 }
 
 void htscodecs_tls_free(void *ptr) {
-    free(ptr);
+    htscodecs_free(ptr);
 }
 #endif
+
+/*
+ * A minimal thread pool for running a fixed set of independent jobs.
+ * Threads are created per call and pull job numbers from a shared counter,
+ * so uneven job sizes balance out.
+ */
+#ifndef NO_THREADS
+typedef struct {
+    pthread_mutex_t lock;
+    int next, njobs;
+    void (*job)(void *job_arg, int i);
+    void *job_arg;
+} par_queue;
+
+static void *par_worker(void *arg) {
+    par_queue *q = (par_queue *)arg;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next < q->njobs ? q->next++ : -1;
+        pthread_mutex_unlock(&q->lock);
+        if (i < 0)
+            break;
+        q->job(q->job_arg, i);
+    }
+    return NULL;
+}
+#endif
+
+int htscodecs_par_run(int nthreads, void (*job)(void *job_arg, int i),
+                      void *job_arg, int njobs) {
+    int i;
+#ifndef NO_THREADS
+    if (nthreads > njobs)
+        nthreads = njobs;
+    if (nthreads > 1) {
+        pthread_t *tid = htscodecs_malloc((nthreads-1) * sizeof(*tid));
+        par_queue q;
+        q.next = 0;
+        q.njobs = njobs;
+        q.job = job;
+        q.job_arg = job_arg;
+        if (!tid || pthread_mutex_init(&q.lock, NULL) != 0) {
+            htscodecs_free(tid);
+            goto serial;
+        }
+
+        // If thread creation fails we simply end up with fewer workers.
+        int nt;
+        for (nt = 0; nt < nthreads-1; nt++)
+            if (pthread_create(&tid[nt], NULL, par_worker, &q) != 0)
+                break;
+        par_worker(&q);
+        for (i = 0; i < nt; i++)
+            pthread_join(tid[i], NULL);
+
+        pthread_mutex_destroy(&q.lock);
+        htscodecs_free(tid);
+        return 0;
+    }
+ serial:
+#endif
+    for (i = 0; i < njobs; i++)
+        job(job_arg, i);
+
+    return 0;
+}
+
+/*
+ * Automatic order selection for the rANS-Nx16 and adaptive arithmetic
+ * codecs.
+ *
+ * Rather than brute force trialing a series of compression methods, we
+ * estimate the size each would produce from the data entropy and an
+ * approximation of the frequency table (or model learning) overheads.
+ * This is only a guide, but it is cheap: one or two histogram passes.
+ */
+#define AUTO_PACK   0x80
+#define AUTO_RLE    0x40
+#define AUTO_CAT    0x20
+#define AUTO_STRIPE 0x08
+
+// 8 * log(2), converting natural log to bytes
+#define AUTO_LN2_8 5.545177444479562
+
+// Fixed costs of the rANS states and order/size meta-data, or of the
+// arithmetic coder flush and meta-data.
+#define AUTO_FIXED(adaptive) ((adaptive) ? 6 : 20)
+
+// Estimated encoded size of an order-0 histogram F of tot symbols.
+static double auto_est_o0(uint32_t *F, uint32_t tot, int adaptive) {
+    if (!tot)
+        return 0;
+
+    double e = 0, lt = log(tot);
+    int i, nsym = 0;
+    for (i = 0; i < 256; i++) {
+        if (!F[i])
+            continue;
+        e += F[i] * (lt - log(F[i]));
+        nsym++;
+    }
+
+    // Frequency table, or approximate adaptive learning cost.
+    // Small data may be stored verbatim instead.
+    e = e / AUTO_LN2_8 + nsym * (adaptive ? 1 : 1.5) + AUTO_FIXED(adaptive);
+    return e < tot + 2 ? e : tot + 2;
+}
+
+// Estimated encoded size from an order-1 histogram and context totals.
+static double auto_est_o1(uint32_t F[256][256], uint32_t *T, int adaptive) {
+    double e = 0;
+    int i, j, nent = 0, nctx = 0;
+    for (i = 0; i < 256; i++) {
+        if (!T[i])
+            continue;
+        double lt = log(T[i]);
+        for (j = 0; j < 256; j++) {
+            if (!F[i][j])
+                continue;
+            e += F[i][j] * (lt - log(F[i][j]));
+            nent++;
+        }
+        nctx++;
+    }
+
+    return e / AUTO_LN2_8 + nent * 1.5 + nctx * (adaptive ? 0 : 2)
+        + AUTO_FIXED(adaptive);
+}
+
+// Estimated size of run length encoding in[], which has order-0
+// histogram F[].  As with hts_rle_encode, only symbols that repeat more
+// often than not are run-length encoded.  This needs a second pass for
+// the histograms of literals (L[]) and run lengths (R[]).
+//
+// Returns HUGE_VAL if there are too few repeats to be worth considering.
+static double auto_est_rle(unsigned char *in, unsigned int in_size,
+                           uint32_t *F, int adaptive) {
+    uint32_t L[256+MAGIC] = {0}, R[256+MAGIC] = {0};
+    uint8_t use_rle[256];
+    unsigned int i, nrep = 0, nlit = 0, nrun = 0;
+
+    if (!in_size)
+        return HUGE_VAL;
+
+    L[in[0]]++;
+    for (i = 1; i < in_size; i++) {
+        int d = in[i] == in[i-1];
+        nrep += d;
+        L[in[i]] += !d;
+    }
+    if (nrep < in_size/8)
+        return HUGE_VAL;
+
+    for (i = 0; i < 256; i++) {
+        use_rle[i] = F[i] - L[i] > L[i];
+        L[i] = 0;
+    }
+
+    for (i = 0; i < in_size; i++) {
+        L[in[i]]++;
+        nlit++;
+        if (use_rle[in[i]]) {
+            unsigned int run = 0;
+            while (i+1 < in_size && in[i+1] == in[i])
+                i++, run++;
+            R[run < 255 ? run : 255]++;
+            nrun++;
+        }
+    }
+
+    return auto_est_o0(L, nlit, adaptive) + auto_est_o0(R, nrun, adaptive);
+}
+
+// Bit-packs in[] into 2, 4 or 8 symbols per byte as hts_pack does,
+// writing the histogram of packed bytes to P[].
+// Returns the packed length.
+static unsigned int auto_pack(unsigned char *in, unsigned int in_size,
+                              uint32_t *F, int nsym,
+                              unsigned char *out, uint32_t *P) {
+    uint8_t map[256];
+    unsigned int i, j, k = nsym <= 2 ? 8 : nsym <= 4 ? 4 : 2, n = 0;
+    int bits = 8 / k;
+
+    for (i = j = 0; i < 256; i++)
+        if (F[i])
+            map[i] = j++;
+
+    for (i = 0; i < in_size; i += k) {
+        unsigned int c = 0;
+        for (j = 0; j < k && i+j < in_size; j++)
+            c |= map[in[i+j]] << (bits*j);
+        P[c]++;
+        out[n++] = c;
+    }
+
+    return n;
+}
+
+/*
+ * Returns a suggested order for in[], composed of order 0 or 1 plus
+ * the PACK, RLE, STRIPE or CAT bits.  For STRIPE, bits 8-15 hold N.
+ *
+ * N is the stripe width to consider, with 0 meaning 4.
+ * Adaptive is true for arith_dynamic, which has no frequency tables
+ * to store but instead pays a model learning cost.
+ *
+ * Order-1 is only estimated on the original data.  When combined with
+ * PACK or RLE we assume it gives the same relative gain over order-0.
+ * The more complex methods must also win by a small margin, as our
+ * estimates are crude.
+ */
+int htscodecs_auto_order(unsigned char *in, unsigned int in_size,
+                         int N, int adaptive) {
+    uint32_t F[256+MAGIC] = {0};
+    unsigned int i, nsym = 0;
+    int order = 0;
+
+    // Too small for the table overheads to pay off.
+    if (in_size <= 20)
+        return adaptive ? 0 : AUTO_CAT;
+
+    if (htscodecs_hist8(in, in_size, F) < 0)
+        return 0;
+    for (i = 0; i < 256; i++)
+        nsym += F[i] != 0;
+
+    double o0 = auto_est_o0(F, in_size, adaptive), best = o0, o1_ratio = 1;
+
+    // Order-1; only when there is enough data for the extra tables.
+    if (nsym > 1 && in_size >= 512) {
+        uint32_t (*F1)[256] = htscodecs_tls_calloc(256, sizeof(*F1));
+        uint32_t T1[256+MAGIC] = {0};
+        if (F1 && htscodecs_hist1_4(in, in_size, F1, T1) == 0) {
+            double o1 = auto_est_o1(F1, T1, adaptive);
+            if (o1 < best) {
+                best = o1;
+                o1_ratio = o1 / o0;
+                order = 1;
+            }
+        }
+        htscodecs_tls_free(F1);
+    }
+
+    // Bit-packing, with and without RLE.  Packing also captures short
+    // periodic patterns, such as in small integers.
+    if (nsym <= 1) {
+        best = nsym + 2;
+        order |= AUTO_PACK;
+    } else if (nsym <= 16) {
+        uint32_t P[256+MAGIC] = {0};
+        unsigned char *packed = htscodecs_tls_alloc(in_size/2 + 1);
+        if (packed) {
+            unsigned int plen = auto_pack(in, in_size, F, nsym, packed, P);
+            double pack = nsym + 2 + auto_est_o0(P, plen, adaptive) * o1_ratio;
+            double pack_rle = nsym + 2
+                + auto_est_rle(packed, plen, P, adaptive) * o1_ratio;
+            if (pack < best) {
+                best = pack;
+                order |= AUTO_PACK;
+            }
+            if (pack_rle < best * 0.95) {
+                best = pack_rle;
+                order |= AUTO_PACK | AUTO_RLE;
+            }
+            htscodecs_tls_free(packed);
+        }
+    }
+
+    // Run length encoding on the unpacked data
+    double rle = auto_est_rle(in, in_size, F, adaptive) * o1_ratio;
+    if (rle < best * 0.95) {
+        best = rle;
+        order = (order & 1) | AUTO_RLE;
+    }
+
+    // N-way striping for fixed size integer data.  Each of the N
+    // sub-streams may be compressed differently, so for simplicity we
+    // assume order-0 or CAT are representative.
+    if (N == 0)
+        N = 4;
+    if (N > 1 && N <= 16 && in_size % N == 0 && in_size >= 8*N) {
+        uint32_t FN[16][256] = {{0}};
+        unsigned int j = 0;
+        for (i = 0; i < in_size; i++) {
+            FN[j][in[i]]++;
+            if (++j == N)
+                j = 0;
+        }
+        double stripe = 7 + 5*N;
+        for (j = 0; j < (unsigned)N; j++)
+            stripe += auto_est_o0(FN[j], in_size / N, adaptive);
+        if (stripe < best * 0.95)
+            return AUTO_STRIPE | (N<<8);
+    }
+
+    return best < in_size ? order : AUTO_CAT;
+}
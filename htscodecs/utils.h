@@ -38,6 +38,8 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include "htscodecs.h"
+
 #if defined(__GNUC__) || defined(__clang__)
 #  if !defined(__clang__) && __GNUC__ >= 100
      // better still on gcc10 for O1 decode of old rans 4x8
@@ -64,6 +66,36 @@ void *htscodecs_tls_alloc(size_t size);
 void *htscodecs_tls_calloc(size_t nmemb, size_t size);
 void  htscodecs_tls_free(void *ptr);
 
+/*
+ * Runs job(job_arg, i) for all i in [0, njobs), using up to nthreads
+ * threads (the calling thread being one of them) and returning once all
+ * have completed.  With nthreads <= 1, or if threads are unavailable,
+ * the jobs are simply run in order.  Returns 0.
+ */
+int htscodecs_par_run(int nthreads, void (*job)(void *job_arg, int i),
+                      void *job_arg, int njobs);
+
+/*
+ * Returns a suggested order (0 or 1 plus PACK, RLE, STRIPE and CAT bits)
+ * for compressing in[] with rANS-Nx16 or arith_dynamic, based on cheap
+ * entropy estimates rather than brute force trials.
+ *
+ * N is the stripe width to consider, or 0 for the default of 4.
+ * Adaptive should be set for arith_dynamic.
+ */
+int htscodecs_auto_order(unsigned char *in, unsigned int in_size,
+                         int N, int adaptive);
+
+/*
+ * Versions of hist8 and hist1_4 below which pick a SIMD implementation
+ * when available, using the same CPU detection and rans_set_cpu
+ * restrictions as the rANS-Nx16 encoders.  The results are identical.
+ */
+int htscodecs_hist8(unsigned char *in, unsigned int in_size,
+                    uint32_t F0[256]);
+int htscodecs_hist1_4(unsigned char *in, unsigned int in_size,
+                      uint32_t F0[256][256], uint32_t *T0);
+
 
 /* Fast approximate log base 2 */
 static inline double fast_log(double a) {
@@ -82,11 +82,13 @@ static unsigned char *load(FILE *infp, uint32_t *lenp) {
 }
 
 int main(int argc, char **argv) {
-    int opt, order = 0;
+    int opt, order = 0, auto_order = 0;
     int decode = 0, test = 0;
     FILE *infp = stdin, *outfp = stdout;
     struct timeval tv1, tv2, tv3, tv4;
     size_t bytes = 0, raw = 0;
+    uint32_t blk_size = BLK_SIZE;
+    int batch = 0;
 
     in_buf = malloc(BLK_SIZE2+257*257*3);
 
@@ -98,7 +100,7 @@ int main(int argc, char **argv) {
     extern char *optarg;
     extern int optind;
 
-    while ((opt = getopt(argc, argv, "o:dtr")) != -1) {
+    while ((opt = getopt(argc, argv, "o:dtrab:B:")) != -1) {
         switch (opt) {
         case 'o': {
             char *optend;
@@ -119,9 +121,28 @@ int main(int argc, char **argv) {
         case 'r':
             raw = 1;
             break;
+
+        case 'a':
+            // Automatic order selection
+            auto_order = ARITH_ORDER_AUTO;
+            break;
+
+        case 'b':
+            blk_size = atoi(optarg);
+            if (blk_size < 1 || blk_size > BLK_SIZE)
+                blk_size = BLK_SIZE;
+            break;
+
+        case 'B':
+            // Compress all blocks with a single arith_compress_batch,
+            // using N threads
+            batch = atoi(optarg);
+            break;
         }
     }
 
+    order |= auto_order;
+
     //order = order ? 1 : 0; // Only support O(0) and O(1)
 
     if (optind < argc) {
@@ -265,13 +286,39 @@ int main(int argc, char **argv) {
 
                 bytes += out_size;
             }
+        } else if (batch) {
+            uint32_t in_size;
+            unsigned char *in = load(infp, &in_size);
+            int i, nb = in_size ? (in_size + (uint64_t)blk_size-1) / blk_size : 1;
+            arith_batch *bb = calloc(nb, sizeof(*bb));
+            if (!bb)
+                exit(1);
+
+            for (i = 0; i < nb; i++) {
+                bb[i].in = in + (uint64_t)i*blk_size;
+                bb[i].in_size = i < nb-1 ? blk_size : in_size - (uint64_t)i*blk_size;
+                bb[i].order = bb[i].in_size < 4 ? order & ~1 : order;
+            }
+
+            if (arith_compress_batch(bb, nb, batch) < 0)
+                exit(1);
+
+            for (i = 0; i < nb; i++) {
+                fwrite(&bb[i].out_size, 1, 4, outfp);
+                fwrite(bb[i].out, 1, bb[i].out_size, outfp);
+                free(bb[i].out);
+            }
+
+            bytes += in_size;
+            free(bb);
+            free(in);
         } else {
             int loop = 0;
             for (;;loop++) {
                 uint32_t in_size, out_size;
                 unsigned char *out;
 
-                in_size = fread(in_buf, 1, BLK_SIZE, infp);
+                in_size = fread(in_buf, 1, blk_size, infp);
                 if (loop && in_size <= 0)
                     break;
 
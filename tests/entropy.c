@@ -55,6 +55,7 @@
 #include <pthread.h>
 #endif
 
+#include "htscodecs/htscodecs.h"
 #include "htscodecs/arith_dynamic.h"
 #include "htscodecs/rANS_static.h"
 #include "htscodecs/rANS_static4x16.h"
@@ -63,6 +64,51 @@
 #   define BLK_SIZE 1024*1024
 #endif
 
+/*
+ * An allocator for -a, checking that every allocation is released by
+ * the matching free function.  Each block is preceded by a header
+ * holding a magic number and its size.
+ */
+#define ALLOC_MAGIC 0x48747341
+typedef struct {
+    uint64_t magic;
+    uint64_t size;
+} alloc_hdr;
+
+static size_t alloc_count = 0;
+
+static void *check_malloc(void *arg, size_t size) {
+    alloc_hdr *h = malloc(sizeof(*h) + size);
+    if (!h)
+        return NULL;
+    h->magic = ALLOC_MAGIC;
+    h->size = size;
+    (*(size_t *)arg)++;
+    return h+1;
+}
+
+static void *check_realloc(void *arg, void *ptr, size_t size) {
+    if (!ptr)
+        return check_malloc(arg, size);
+    alloc_hdr *h = (alloc_hdr *)ptr - 1;
+    if (h->magic != ALLOC_MAGIC)
+        abort();
+    if (!(h = realloc(h, sizeof(*h) + size)))
+        return NULL;
+    h->size = size;
+    return h+1;
+}
+
+static void check_free(void *arg, void *ptr) {
+    if (!ptr)
+        return;
+    alloc_hdr *h = (alloc_hdr *)ptr - 1;
+    if (h->magic != ALLOC_MAGIC)
+        abort();
+    h->magic = 0;
+    free(h);
+}
+
 // Max 4GB
 static unsigned char *load(FILE *infp, uint32_t *lenp) {
     unsigned char *data = NULL;
@@ -101,11 +147,20 @@ int main(int argc, char **argv) {
     extern void rans_disable_avx512(void);
     extern void rans_disable_avx2(void);
 
-    int benchmark = 0;
-    while (argc > 1 && strcmp(argv[1], "-b") == 0) {
-        benchmark++;
-        argc--;
-        argv++;
+    int benchmark = 0, check_alloc = 0;
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+        if (strcmp(argv[1], "-b") == 0)
+            benchmark++;
+        else if (strcmp(argv[1], "-a") == 0)
+            check_alloc = 1;
+    }
+
+    if (check_alloc) {
+        htscodecs_allocator a = {
+            check_malloc, NULL, check_realloc, check_free, &alloc_count
+        };
+        if (htscodecs_set_allocator(&a) < 0)
+            return 1;
     }
 
     if (argc > 1) {
@@ -238,17 +293,20 @@ int main(int argc, char **argv) {
                 }
 
                 if (comp != comp0)
-                    free(comp);
-                free(uncomp);
+                    htscodecs_free(comp);
+                htscodecs_free(uncomp);
                 if (--bloop > 0) goto bloop;
             }
-            free(comp0);
+            htscodecs_free(comp0);
         }
         printf("\n");
     }
 
     free(in);
 
+    if (check_alloc)
+        fprintf(stderr, "%ld allocations\n", (long)alloc_count);
+
     if (result != EXIT_SUCCESS)
         return result;
 
@@ -323,6 +323,7 @@ int main(int argc, char **argv) {
     int strat = 0, raw = 0;
     fqz_gparams *gp = NULL, gp_local;
     uint32_t blk_size = BLK_SIZE; // MAX
+    int nseg = 1, nthreads = 1, sample = 0, ntune = 0;
 
 #ifdef _WIN32
         _setmode(_fileno(stdin),  _O_BINARY);
@@ -333,7 +334,7 @@ int main(int argc, char **argv) {
     extern int optind;
     int opt;
 
-    while ((opt = getopt(argc, argv, "ds:s:b:rx:")) != -1) {
+    while ((opt = getopt(argc, argv, "ds:s:b:rx:S:p:n:A:")) != -1) {
         switch (opt) {
         case 'd':
             decomp = 1;
@@ -369,6 +370,26 @@ int main(int argc, char **argv) {
         case 'r':
             raw = 1;
             break;
+
+        case 'S':
+            // Split records into N independent segments
+            nseg = atoi(optarg);
+            break;
+
+        case 'p':
+            // Number of threads for segmented data
+            nthreads = atoi(optarg);
+            break;
+
+        case 'n':
+            // Pick parameters from every Nth record only
+            sample = atoi(optarg);
+            break;
+
+        case 'A':
+            // Auto-tune parameters, N times via a cache to test reuse
+            ntune = atoi(optarg);
+            break;
         }
     }
 
@@ -398,7 +419,7 @@ int main(int argc, char **argv) {
             fprintf(stderr, "out_len %ld, in_len %ld\n", (long)out_len, (long)in2_len);
 
             int *lengths = malloc(MAX_REC * sizeof(int));
-            out = (unsigned char *)fqz_decompress((char *)in2, in_len-(raw?0:8), &out_len, lengths, MAX_REC);
+            out = (unsigned char *)fqz_decompress_mt((char *)in2, in_len-(raw?0:8), &out_len, lengths, MAX_REC, nthreads);
             if (!out) {
                 fprintf(stderr, "Failed to decompress\n");
                 return 1;
@@ -443,7 +464,21 @@ int main(int argc, char **argv) {
             if (gp == &gp_local)
                 if (fqz_manual_parameters(gp, s, in2, in2_len) < 0)
                     return 1;
-            out = (unsigned char *)fqz_compress(vers, s, (char *)in2, in2_len, &out_len, strat, gp);
+            if (ntune > 0) {
+                fqz_tune_cache *cache = fqz_tune_cache_create();
+                int i;
+                for (i = 0; i < ntune; i++) {
+                    if (i)
+                        fqz_destroy_parameters(&gp_local);
+                    s = fake_slice(in2_len, rec_len, rec_r2, rec_sel, nlines);
+                    if (fqz_tune_parameters(&gp_local, vers, s, in2, in2_len,
+                                            cache, 0) < 0)
+                        return 1;
+                }
+                fqz_tune_cache_destroy(cache);
+                gp = &gp_local;
+            }
+            out = (unsigned char *)fqz_compress_mt(vers, s, (char *)in2, in2_len, &out_len, strat | FQZ_STRAT_SAMPLE(sample), gp, nseg, nthreads);
 
             // Write out 32-bit sizes.
             if (!raw) {
@@ -452,6 +487,8 @@ int main(int argc, char **argv) {
                 u32 = out_len; if (write(1, &u32, 4) != 4) return 1;
             }
             if (write(1, out, out_len) < 0) return 1;
+            if (ntune > 0)
+                fqz_destroy_parameters(gp);
             in_len -= in2_len;
             in2 += in2_len;
             t_out += out_len + (raw?0:8);
@@ -43,6 +43,7 @@
 #include <sys/time.h>
 
 #include "htscodecs/rANS_static4x16.h"
+#include "htscodecs/utils.h"
 
 #ifndef BLK_SIZE
 // Divisible by 4 for X4.
@@ -85,6 +86,16 @@ int main(int argc, char **argv) {
     struct timeval tv1, tv2, tv3, tv4;
     size_t bytes = 0, raw = 0;
     uint32_t blk_size = BLK_SIZE;
+    rans4x16_ctx *ctx = NULL;
+    int par_order = 0, auto_order = 0;
+    int use_model = 0;
+    int hist_only = 0;
+    unsigned int stream_chunk = 0, stream_buf = 0;
+    int range = 0;
+    unsigned int range_start = 0, range_len = 0;
+    int ckpt_order = 0;
+    int batch = 0;
+    rans4x16_model *model = NULL;
 
 #ifdef _WIN32
         _setmode(_fileno(stdin),  _O_BINARY);
@@ -97,7 +108,7 @@ int main(int argc, char **argv) {
     extern void rans_disable_avx512(void);
     extern void rans_disable_avx2(void);
 
-    while ((opt = getopt(argc, argv, "o:dtrc:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "o:dtrc:b:xp:P:MaHS:w:k:R:B")) != -1) {
         switch (opt) {
         case 'o': {
             char *optend;
@@ -127,9 +138,73 @@ int main(int argc, char **argv) {
         case 'b':
             blk_size = atoi(optarg);
             break;
+
+        case 'x':
+            // Reuse a context for all blocks
+            if (!ctx && !(ctx = rans4x16_ctx_create()))
+                return 1;
+            break;
+
+        case 'p':
+            // Number of threads for RANS_ORDER_PARALLEL
+            if (!ctx && !(ctx = rans4x16_ctx_create()))
+                return 1;
+            rans4x16_ctx_set_threads(ctx, atoi(optarg));
+            break;
+
+        case 'M':
+            // Encode blocks against a static model built from the first
+            use_model = 1;
+            break;
+
+        case 'P':
+            // Enable RANS_ORDER_PARALLEL with 2^N sized sub-blocks
+            par_order = RANS_ORDER_PARALLEL
+                | (atoi(optarg) << RANS_ORDER_PAR_SHIFT);
+            break;
+
+        case 'a':
+            // Automatic order selection
+            auto_order = RANS_ORDER_AUTO;
+            break;
+
+        case 'H':
+            // With -t, time just the order-0 or order-1 histogram
+            hist_only = 1;
+            break;
+
+        case 'S':
+            // With -r -d, decode via the streaming API in chunks of N
+            stream_chunk = atoi(optarg);
+            break;
+
+        case 'w':
+            // Buffer size for the streaming decoder
+            stream_buf = atoi(optarg);
+            break;
+
+        case 'k':
+            // Enable RANS_ORDER_CHECKPOINT every 2^N bytes
+            ckpt_order = RANS_ORDER_CHECKPOINT
+                | (atoi(optarg) << RANS_ORDER_CKPT_SHIFT);
+            break;
+
+        case 'R':
+            // With -r -d, decode only "start,len"
+            range = 1;
+            if (sscanf(optarg, "%u,%u", &range_start, &range_len) != 2)
+                return 1;
+            break;
+
+        case 'B':
+            // Compress all blocks with a single rans_compress_batch_4x16
+            batch = 1;
+            break;
         }
     }
 
+    order |= par_order | auto_order | ckpt_order;
+
     // Room to allow for expanded BLK_SIZE on worst case compression.
     uint32_t blk_size2 = (105LL*blk_size)/100;
     in_buf = malloc(blk_size2+257*257*3);
@@ -202,6 +277,37 @@ int main(int argc, char **argv) {
 #define NTRIALS 5
 #endif
         int trials = NTRIALS;
+
+        if (hist_only) {
+            // Includes clearing the tables, as all callers must do this
+            uint32_t (*F)[256] = malloc(256 * sizeof(*F));
+            uint32_t T[256];
+            while (trials--) {
+                gettimeofday(&tv1, NULL);
+
+                for (i = 0; i < nb; i++) {
+                    if (order & 1) {
+                        memset(F, 0, 256 * sizeof(*F));
+                        memset(T, 0, sizeof(T));
+                        htscodecs_hist1_4(b[i].blk, b[i].sz, F, T);
+                    } else {
+                        memset(F[0], 0, sizeof(*F));
+                        htscodecs_hist8(b[i].blk, b[i].sz, F[0]);
+                    }
+                }
+
+                gettimeofday(&tv2, NULL);
+
+                fprintf(stderr, "%5.1f MB/s hist%d\t %ld bytes\n",
+                        (double)in_sz /
+                        ((long)(tv2.tv_sec - tv1.tv_sec)*1000000 +
+                         tv2.tv_usec - tv1.tv_usec),
+                        order & 1, (long)in_sz);
+            }
+            free(F);
+            exit(0);
+        }
+
         while (trials--) {
             // Warmup
             for (i = 0; i < nb; i++) memset(bc[i].blk, 0, bc[i].sz);
@@ -211,7 +317,7 @@ int main(int argc, char **argv) {
             out_sz = 0;
             for (i = 0; i < nb; i++) {
                 unsigned int csz = bc[i].sz;
-                bc[i].blk = rans_compress_to_4x16(b[i].blk, b[i].sz, bc[i].blk, &csz, order);
+                bc[i].blk = rans_compress_ctx(ctx, b[i].blk, b[i].sz, bc[i].blk, &csz, order);
                 assert(csz <= bc[i].sz);
                 bc[i].csz = csz;
                 out_sz += 5 + csz;
@@ -225,7 +331,7 @@ int main(int argc, char **argv) {
             gettimeofday(&tv3, NULL);
 
             for (i = 0; i < nb; i++)
-                bu[i].blk = rans_uncompress_to_4x16(bc[i].blk, bc[i].csz, bu[i].blk, &bu[i].sz);
+                bu[i].blk = rans_uncompress_ctx(ctx, bc[i].blk, bc[i].csz, bu[i].blk, &bu[i].sz);
 
             gettimeofday(&tv4, NULL);
 
@@ -263,14 +369,34 @@ int main(int argc, char **argv) {
         // sanitizer to check for input buffer overruns.
         in = realloc(in, in_size);
 
-        if (decode) {
-            if (!(out = rans_uncompress_4x16(in, in_size, &out_size)))
+        if (decode && range) {
+            if (!(out = rans_uncompress_range_4x16(in, in_size, range_start,
+                                                   range_len, NULL)))
+                exit(1);
+
+            fwrite(out, 1, range_len, outfp);
+            bytes = range_len;
+        } else if (decode && stream_chunk) {
+            rans4x16_stream *s = rans4x16_stream_init(in, in_size,
+                                                      stream_buf);
+            int n;
+            if (!s || !(out = malloc(stream_chunk)))
+                exit(1);
+            while ((n = rans4x16_stream_next(s, out, stream_chunk)) > 0) {
+                fwrite(out, 1, n, outfp);
+                bytes += n;
+            }
+            if (rans4x16_stream_finish(s) < 0 || n < 0)
+                exit(1);
+        } else if (decode) {
+            if (!(out = rans_uncompress_ctx(ctx, in, in_size, NULL, &out_size)))
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
             bytes = out_size;
         } else {
-            if (!(out = rans_compress_4x16(in, in_size, &out_size, order)))
+            if (!(out = rans_compress_ctx(ctx, in, in_size, NULL, &out_size,
+                                          order)))
                 exit(1);
 
             fwrite(out, 1, out_size, outfp);
@@ -285,6 +411,18 @@ int main(int argc, char **argv) {
             //RC_init();
             //RC_init2();
 
+            if (use_model) {
+                // Model is stored first, prior to the blocks
+                uint32_t msize;
+                unsigned char *mdata;
+                if (4 != fread(&msize, 1, 4, infp) ||
+                    !(mdata = malloc(msize)) ||
+                    msize != fread(mdata, 1, msize, infp) ||
+                    !(model = rans4x16_model_load(mdata, msize)))
+                    exit(1);
+                free(mdata);
+            }
+
             for (;;) {
                 uint32_t in_size, out_size;
                 unsigned char *out;
@@ -298,7 +436,11 @@ int main(int argc, char **argv) {
                     fprintf(stderr, "Truncated input\n");
                     exit(1);
                 }
-                out = rans_uncompress_4x16(in_buf, in_size, &out_size);
+                out = model
+                    ? rans_uncompress_model_4x16(&model, 1, in_buf, in_size,
+                                                 NULL, &out_size)
+                    : rans_uncompress_ctx(ctx, in_buf, in_size, NULL,
+                                          &out_size);
                 if (!out)
                     exit(1);
 
@@ -308,6 +450,32 @@ int main(int argc, char **argv) {
 
                 bytes += out_size;
             }
+        } else if (batch) {
+            uint32_t in_size;
+            unsigned char *in = load(infp, &in_size);
+            int i, nb = in_size ? (in_size + (uint64_t)blk_size-1) / blk_size : 1;
+            rans4x16_batch *bb = calloc(nb, sizeof(*bb));
+            if (!bb)
+                exit(1);
+
+            for (i = 0; i < nb; i++) {
+                bb[i].in = in + (uint64_t)i*blk_size;
+                bb[i].in_size = i < nb-1 ? blk_size : in_size - (uint64_t)i*blk_size;
+                bb[i].order = bb[i].in_size < 4 ? order & ~1 : order;
+            }
+
+            if (rans_compress_batch_4x16(ctx, bb, nb) < 0)
+                exit(1);
+
+            for (i = 0; i < nb; i++) {
+                fwrite(&bb[i].out_size, 1, 4, outfp);
+                fwrite(bb[i].out, 1, bb[i].out_size, outfp);
+                free(bb[i].out);
+            }
+
+            bytes += in_size;
+            free(bb);
+            free(in);
         } else {
             int loop = 0;
             for (;;loop++) {
@@ -321,7 +489,23 @@ int main(int argc, char **argv) {
                 if (in_size < 4)
                     order &= ~1;
 
-                out = rans_compress_4x16(in_buf, in_size, &out_size, order);
+                if (use_model && !model) {
+                    uint32_t msize;
+                    unsigned char *mdata;
+                    if (!(model = rans4x16_model_build(in_buf, in_size,
+                                                       order, 1)) ||
+                        !(mdata = rans4x16_model_store(model, &msize)))
+                        exit(1);
+                    fwrite(&msize, 1, 4, outfp);
+                    fwrite(mdata, 1, msize, outfp);
+                    free(mdata);
+                }
+
+                out = model
+                    ? rans_compress_model_4x16(model, in_buf, in_size,
+                                               NULL, &out_size)
+                    : rans_compress_ctx(ctx, in_buf, in_size, NULL, &out_size,
+                                        order);
 
                 fwrite(&out_size, 1, 4, outfp);
                 fwrite(out, 1, out_size, outfp);
@@ -341,5 +525,7 @@ int main(int argc, char **argv) {
                              tv2.tv_usec - tv1.tv_usec));
 
     free(in_buf);
+    rans4x16_ctx_destroy(ctx);
+    rans4x16_model_destroy(model);
     return 0;
 }
@@ -48,6 +48,25 @@ int LLVMFuzzerTestOneInput(uint8_t *in, size_t in_size) {
     unsigned char *uncomp = tok3_decode_names(in, in_size, &uncomp_size);
     if (uncomp)
         free(uncomp);
+
+    int tokens[] = {1, 2, 4, 6, 8};
+    int64_t *fields = tok3_decode_fields(in, in_size, tokens, 5,
+                                         &uncomp_size);
+    if (fields)
+        free(fields);
+
+    uint32_t out_size, nnames, out_len;
+    if (tok3_decode_names_size(in, in_size, &out_size, &nnames) == 0 &&
+        out_size <= 1000000 && nnames <= 100000) {
+        uint8_t *out = malloc(out_size);
+        uint32_t *offsets = malloc((nnames+1) * 2 * sizeof(*offsets));
+        if (out && offsets)
+            tok3_decode_names_to(in, in_size, out, out_size,
+                                 offsets, offsets + nnames+1, nnames+1,
+                                 &out_len, &nnames, 1);
+        free(out);
+        free(offsets);
+    }
     
     return 0;
 }
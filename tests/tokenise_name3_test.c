@@ -57,6 +57,8 @@
 #define BLK_SIZE 1*1024*1024
 #endif
 static char *blk;
+static int nthreads = 1;
+static int blk_size = BLK_SIZE;
 
 // Max 4GB
 static unsigned char *load(FILE *infp, uint32_t *lenp) {
@@ -89,6 +91,8 @@ static int encode(int argc, char **argv) {
     int len, level = 9;
     int use_arith = 0;
     int raw = 0;
+    int long_names = 0;
+    tok3_enc_ctx *ec = NULL;
 
     while (argc > 1 && argv[1][0] == '-') {
         if (strcmp(argv[1], "-r") == 0) {
@@ -97,6 +101,36 @@ static int encode(int argc, char **argv) {
             argv++;
         }
 
+        else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+            nthreads = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+
+        else if (strcmp(argv[1], "-b") == 0 && argc > 2) {
+            // Block size in bytes
+            blk_size = atoi(argv[2]);
+            if (blk_size < 1 || blk_size > BLK_SIZE)
+                blk_size = BLK_SIZE;
+            argc -= 2;
+            argv += 2;
+        }
+
+        else if (strcmp(argv[1], "-C") == 0) {
+            // Reuse a persistent context for all blocks
+            if (!ec && !(ec = tok3_enc_ctx_create()))
+                exit(1);
+            argc--;
+            argv++;
+        }
+
+        else if (strcmp(argv[1], "-L") == 0) {
+            // Permit up to 256 tokens per name
+            long_names = TOK3_LONG_NAMES;
+            argc--;
+            argv++;
+        }
+
         else if (argv[1][1] >= '0' && argv[1][1] <= '9') {
             level = atoi(argv[1]+1);
             if (level > 10) {
@@ -110,6 +144,7 @@ static int encode(int argc, char **argv) {
         else
             exit(1);
     }
+    level |= long_names;
 
     if (argc > 1) {
         fp = fopen(argv[1], "r");
@@ -121,14 +156,20 @@ static int encode(int argc, char **argv) {
         fp = stdin;
     }
 
+    if (ec)
+        tok3_enc_ctx_set_threads(ec, nthreads);
+
     if (raw) {
         // One naked / raw block, to match the specification
         uint32_t in_len;
         int out_len;
         unsigned char *in = load(fp, &in_len), *out;
         if (!in) exit(1);
-        out = tok3_encode_names((char *)in, in_len, level, use_arith,
-                                &out_len, NULL);
+        out = ec
+            ? tok3_encode_names_ctx(ec, (char *)in, in_len, level, use_arith,
+                                    &out_len, NULL)
+            : tok3_encode_names_mt((char *)in, in_len, level, use_arith,
+                                   &out_len, NULL, nthreads);
         if (!out || write(1, out, out_len) < out_len) exit(1);   // encoded data
         free(in);
         free(out);
@@ -138,14 +179,17 @@ static int encode(int argc, char **argv) {
         for (;;) {
             int last_start = 0;
 
-            len = fread(blk+blk_offset, 1, BLK_SIZE-blk_offset, fp);
+            len = fread(blk+blk_offset, 1, blk_size-blk_offset, fp);
             if (len <= 0)
                 break;
             len += blk_offset;
 
             int out_len;
-            uint8_t *out = tok3_encode_names(blk, len, level, use_arith,
-                                             &out_len, &last_start);
+            uint8_t *out = ec
+                ? tok3_encode_names_ctx(ec, blk, len, level, use_arith,
+                                        &out_len, &last_start)
+                : tok3_encode_names_mt(blk, len, level, use_arith,
+                                       &out_len, &last_start, nthreads);
             if (!out) {
                 fprintf(stderr, "Couldn't encode names\n");
                 exit(1);
@@ -160,6 +204,8 @@ static int encode(int argc, char **argv) {
         }
     }
 
+    tok3_enc_ctx_destroy(ec);
+
     if (fclose(fp) < 0) {
         perror("closing file");
         return 1;
@@ -168,14 +214,88 @@ static int encode(int argc, char **argv) {
     return 0;
 }
 
+// Prints the numeric token values from tok3_decode_fields, one line
+// per name.
+static int print_fields(uint8_t *in, uint32_t in_sz, int *tokens,
+                        int ntokens) {
+    uint32_t i, nnames;
+    int f;
+    int64_t *v = tok3_decode_fields(in, in_sz, tokens, ntokens, &nnames);
+    if (!v)
+        return -1;
+
+    for (i = 0; i < nnames; i++)
+        for (f = 0; f < ntokens; f++)
+            printf("%"PRId64"%c", v[i*ntokens+f], f+1 < ntokens ? '\t' : '\n');
+
+    free(v);
+    return 0;
+}
+
+// Decodes with tok3_decode_names_to, writing the names one at a time
+// from the offsets and lengths to check they match the buffer.
+static int write_names_to(uint8_t *in, uint32_t in_sz) {
+    uint32_t out_size, out_len, nnames, i;
+    if (tok3_decode_names_size(in, in_sz, &out_size, &nnames) < 0)
+        return -1;
+
+    uint8_t *out = malloc(out_size);
+    uint32_t *offsets = malloc((nnames+1) * sizeof(*offsets));
+    uint32_t *lengths = malloc((nnames+1) * sizeof(*lengths));
+    int ret = -1;
+    if (!out || !offsets || !lengths)
+        goto err;
+
+    if (tok3_decode_names_to(in, in_sz, out, out_size, offsets, lengths,
+                             nnames, &out_len, &nnames, nthreads) < 0)
+        goto err;
+
+    for (i = 0; i < nnames; i++) {
+        if (out[offsets[i]+lengths[i]] != 0 ||
+            fwrite(out+offsets[i], 1, lengths[i]+1, stdout) != lengths[i]+1)
+            goto err;
+    }
+    ret = 0;
+
+ err:
+    free(out);
+    free(offsets);
+    free(lengths);
+    return ret;
+}
+
 static int decode(int argc, char **argv) {
     uint32_t in_sz, out_sz;
-    int raw = 0;
+    int raw = 0, to = 0;
+    int tokens[256], ntokens = 0;
 
-    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
-        raw = 1;
-        argc--;
-        argv++;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-r") == 0) {
+            raw = 1;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+            nthreads = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (strcmp(argv[1], "-z") == 0) {
+            // Decode into our own buffer with tok3_decode_names_to
+            to = 1;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+            // Comma separated token numbers to decode as numbers
+            char *cp = argv[2];
+            do {
+                if (ntokens == 256)
+                    exit(1);
+                tokens[ntokens++] = strtol(cp, &cp, 10);
+            } while (*cp++ == ',');
+            argc -= 2;
+            argv += 2;
+        } else {
+            exit(1);
+        }
     }
 
     if (raw) {
@@ -184,7 +304,15 @@ static int decode(int argc, char **argv) {
         unsigned char *in = load(stdin, &in_len), *out;
         if (!in) exit(1);
 
-        if ((out = tok3_decode_names(in, in_len, &out_sz)) == NULL)
+        if (ntokens || to) {
+            if (ntokens ? print_fields(in, in_len, tokens, ntokens) < 0
+                        : write_names_to(in, in_len) < 0)
+                exit(1);
+            free(in);
+            return 0;
+        }
+
+        if ((out = tok3_decode_names_mt(in, in_len, &out_sz, nthreads)) == NULL)
             exit(1);
         if (write(1, out, out_sz) != out_sz)
             exit(1);
@@ -202,7 +330,17 @@ static int decode(int argc, char **argv) {
                 return -1;
             }
 
-            if ((out = tok3_decode_names(in, in_sz, &out_sz)) == NULL) {
+            if (ntokens || to) {
+                if (ntokens ? print_fields(in, in_sz, tokens, ntokens) < 0
+                            : write_names_to(in, in_sz) < 0) {
+                    free(in);
+                    return -1;
+                }
+                free(in);
+                continue;
+            }
+
+            if ((out = tok3_decode_names_mt(in, in_sz, &out_sz, nthreads)) == NULL) {
                 free(in);
                 return -1;
             }